@@ -27,6 +27,9 @@ public:
     double& A() {return _A;}
     double A() const {return _A;}
 
+    /// Highest the plate gets at the current amplitude
+    double top() const {return _z0 + std::abs(_A);}
+
 private:
     double _z0{0};
     double _z{0};
@@ -0,0 +1,47 @@
+#include "ContactHistory.h"
+
+Eigen::Vector3d& ContactHistory::touch(size_t key, unsigned int now) {
+    for (int s{0}; s < count; s++) {
+        int n = cursor + s < count ? cursor + s : cursor + s - count;
+        Entry& e = at(n);
+        if (e.key == key) {
+            cursor = n + 1 < count ? n + 1 : 0;
+            return e.spring.advance(now);
+        }
+    }
+
+    // New contact, reuse an expired entry if there is one
+    int n{0};
+    while (n < count && !at(n).spring.expired(now)) n++;
+    if (n == count) {
+        if (count >= inline_capacity) overflow.emplace_back();
+        count++;
+    }
+    Entry& e = at(n);
+    e.key = key;
+    e.spring = ContactSpring{};
+    cursor = n + 1 < count ? n + 1 : 0;
+    return e.spring.advance(now);
+}
+
+void ContactHistory::pack(std::vector<double>& out) const {
+    // Keys and epochs are well inside the integers a double holds exactly
+    out.push_back(count);
+    for (int n{0}; n < count; n++) {
+        const Entry& e = at(n);
+        out.insert(out.end(), {double(e.key), e.spring.elongation.x(), e.spring.elongation.y(),
+                               e.spring.elongation.z(), double(e.spring.epoch)});
+    }
+}
+
+const double* ContactHistory::unpack(const double* in) {
+    int n_entries = int(*in++);
+    for (int n{0}; n < n_entries; n++, in += 5) {
+        if (count >= inline_capacity) overflow.emplace_back();
+        Entry& e = at(count++);
+        e.key = size_t(in[0]);
+        e.spring.elongation = {in[1], in[2], in[3]};
+        e.spring.epoch = (unsigned int)in[4];
+    }
+    return in;
+}
@@ -0,0 +1,67 @@
+#ifndef INC_3DMOLECULARDYNAMICS_CONTACTHISTORY_H
+#define INC_3DMOLECULARDYNAMICS_CONTACTHISTORY_H
+
+#include <Eigen/Dense>
+#include <array>
+#include <vector>
+
+/// Tangential spring of a single contact.
+///
+/// The spring is stamped with the epoch (force evaluation) it was last
+/// touched in. A contact that wasn't touched in the previous epoch has
+/// ended, so its spring is restarted rather than deleted. Epochs count up
+/// from 2, so a default constructed spring has always expired.
+struct ContactSpring {
+    Eigen::Vector3d elongation{0, 0, 0};
+    unsigned int epoch{0};
+
+    /// Returns the elongation to accumulate into during epoch now,
+    /// zeroed first if the contact had lapsed.
+    Eigen::Vector3d& advance(unsigned int now) {
+        if (now - epoch > 1) elongation = Eigen::Vector3d(0, 0, 0);
+        epoch = now;
+        return elongation;
+    }
+
+    bool expired(unsigned int now) const { return now - epoch > 1; }
+};
+
+/// Springs of one particle's contacts, keyed by the index of the other body.
+///
+/// The first inline_capacity contacts are stored in place; beyond that an
+/// overflow vector is used, which keeps its capacity once grown. Expired
+/// entries are reused for new contacts instead of being erased, so after
+/// warm up no call allocates.
+class ContactHistory {
+public:
+    static constexpr int inline_capacity = 12;
+
+    /// Spring for the contact with key during epoch now.
+    Eigen::Vector3d& touch(size_t key, unsigned int now);
+
+    /// Appends the contacts to out, to move them to another process.
+    void pack(std::vector<double>& out) const;
+
+    /// Adds the contacts packed at in, returns the position just after them.
+    const double* unpack(const double* in);
+
+private:
+    struct Entry {
+        size_t key;
+        ContactSpring spring;
+    };
+
+    Entry& at(int n) { return n < inline_capacity ? slots[n] : overflow[n - inline_capacity]; }
+    const Entry& at(int n) const { return n < inline_capacity ? slots[n] : overflow[n - inline_capacity]; }
+
+    std::array<Entry, inline_capacity> slots;
+    std::vector<Entry> overflow;
+    int count{0};
+
+    /// Contacts are found in the same order every step, so the search for
+    /// the next key starts just after the last one found.
+    int cursor{0};
+};
+
+
+#endif //INC_3DMOLECULARDYNAMICS_CONTACTHISTORY_H
@@ -0,0 +1,202 @@
+#include "Domain.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+
+MpiSession::MpiSession(int& argc, char**& argv) {
+#ifdef USE_MPI
+    // Only the main thread talks to MPI, the workers never do
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    MPI_Comm_rank(MPI_COMM_WORLD, &_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &_size);
+#else
+    (void)argc;
+    (void)argv;
+#endif
+}
+
+MpiSession::~MpiSession() {
+#ifdef USE_MPI
+    MPI_Finalize();
+#endif
+}
+
+Domain::Domain() {
+#ifdef USE_MPI
+    MPI_Comm_rank(MPI_COMM_WORLD, &_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &_size);
+#endif
+}
+
+bool Domain::choose_grid(int ranks, double width, double height, int max_px, int max_py, int& px, int& py) {
+    // Shortest edges per subdomain means the fewest ghosts
+    double best = std::numeric_limits<double>::infinity();
+    for (int x{1}; x <= ranks; x++) {
+        if (ranks % x != 0) continue;
+        int y = ranks / x;
+        if (x > max_px || y > max_py) continue;
+        double edges = width / x + height / y;
+        if (edges < best) {
+            best = edges;
+            px = x;
+            py = y;
+        }
+    }
+    return best < std::numeric_limits<double>::infinity();
+}
+
+void Domain::decompose(int nx, int ny) {
+    Nx = nx;
+    Ny = ny;
+    if (!choose_grid(_size, Nx, Ny, Nx, Ny, px, py)) {
+        abort("Can't split " + std::to_string(Nx) + " x " + std::to_string(Ny) + " cells between "
+              + std::to_string(_size) + " processes");
+    }
+
+    // Rank rx*py + ry has the cells of block (rx, ry)
+    int rx = _rank / py, ry = _rank % py;
+    x0 = Nx*rx / px;
+    x1 = Nx*(rx + 1) / px;
+    y0 = Ny*ry / py;
+    y1 = Ny*(ry + 1) / py;
+
+    _neighbours.clear();
+    for (int dx{-1}; dx <= 1; dx++) {
+        for (int dy{-1}; dy <= 1; dy++) {
+            int r = ((rx + dx + px) % px)*py + (ry + dy + py) % py;
+            if (r != _rank && std::find(_neighbours.begin(), _neighbours.end(), r) == _neighbours.end()) {
+                _neighbours.push_back(r);
+            }
+        }
+    }
+}
+
+int Domain::owner(int cell) const {
+    // Inverse of x0 = Nx*rx/px
+    int ix = cell / Ny, iy = cell % Ny;
+    int rx = ((ix + 1)*px - 1) / Nx;
+    int ry = ((iy + 1)*py - 1) / Ny;
+    return rx*py + ry;
+}
+
+int Domain::neighbour_index(int rank) const {
+    auto it = std::find(_neighbours.begin(), _neighbours.end(), rank);
+    return it == _neighbours.end() ? -1 : int(it - _neighbours.begin());
+}
+
+void Domain::exchange(const std::vector<std::vector<double>>& send, std::vector<std::vector<double>>& recv,
+                      bool sizes_known) const {
+    recv.resize(_neighbours.size());
+#ifdef USE_MPI
+    int n = int(_neighbours.size());
+    std::vector<MPI_Request> requests(2*n);
+    if (!sizes_known) {
+        std::vector<unsigned long> send_size(n), recv_size(n);
+        for (int k{0}; k < n; k++) {
+            send_size[k] = send[k].size();
+            MPI_Irecv(&recv_size[k], 1, MPI_UNSIGNED_LONG, _neighbours[k], 0, MPI_COMM_WORLD, &requests[k]);
+            MPI_Isend(&send_size[k], 1, MPI_UNSIGNED_LONG, _neighbours[k], 0, MPI_COMM_WORLD, &requests[n + k]);
+        }
+        MPI_Waitall(2*n, requests.data(), MPI_STATUSES_IGNORE);
+        for (int k{0}; k < n; k++) recv[k].resize(recv_size[k]);
+    }
+    for (int k{0}; k < n; k++) {
+        MPI_Irecv(recv[k].data(), int(recv[k].size()), MPI_DOUBLE, _neighbours[k], 1, MPI_COMM_WORLD, &requests[k]);
+        MPI_Isend(send[k].data(), int(send[k].size()), MPI_DOUBLE, _neighbours[k], 1, MPI_COMM_WORLD,
+                  &requests[n + k]);
+    }
+    MPI_Waitall(2*n, requests.data(), MPI_STATUSES_IGNORE);
+#else
+    (void)send;
+    (void)sizes_known;
+#endif
+}
+
+bool Domain::any(bool value) const {
+#ifdef USE_MPI
+    if (distributed()) {
+        int local = value, global;
+        MPI_Allreduce(&local, &global, 1, MPI_INT, MPI_LOR, MPI_COMM_WORLD);
+        return global != 0;
+    }
+#endif
+    return value;
+}
+
+double Domain::sum(double value) const {
+#ifdef USE_MPI
+    if (distributed()) MPI_Allreduce(MPI_IN_PLACE, &value, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+#endif
+    return value;
+}
+
+double Domain::min(double value) const {
+#ifdef USE_MPI
+    if (distributed()) MPI_Allreduce(MPI_IN_PLACE, &value, 1, MPI_DOUBLE, MPI_MIN, MPI_COMM_WORLD);
+#endif
+    return value;
+}
+
+double Domain::max(double value) const {
+#ifdef USE_MPI
+    if (distributed()) MPI_Allreduce(MPI_IN_PLACE, &value, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+#endif
+    return value;
+}
+
+unsigned int Domain::broadcast(unsigned int value) const {
+#ifdef USE_MPI
+    if (distributed()) MPI_Bcast(&value, 1, MPI_UNSIGNED, 0, MPI_COMM_WORLD);
+#endif
+    return value;
+}
+
+void Domain::abort(const std::string& message) const {
+    std::cerr << message << std::endl;
+#ifdef USE_MPI
+    MPI_Abort(MPI_COMM_WORLD, 1);
+#endif
+    std::exit(1);
+}
+
+OutputFile::~OutputFile() {
+    close();
+}
+
+void OutputFile::open(const std::string& path, const Domain& domain) {
+#ifdef USE_MPI
+    if (domain.distributed()) {
+        MPI_File_open(MPI_COMM_WORLD, path.c_str(), MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &shared);
+        MPI_File_set_size(shared, 0);
+        return;
+    }
+#else
+    (void)domain;
+#endif
+    file = std::fopen(path.c_str(), "w");
+}
+
+void OutputFile::write(const std::string& text) {
+#ifdef USE_MPI
+    if (shared != MPI_FILE_NULL) {
+        MPI_File_write_ordered(shared, text.data(), int(text.size()), MPI_CHAR, MPI_STATUS_IGNORE);
+        return;
+    }
+#endif
+    std::fwrite(text.data(), 1, text.size(), file);
+}
+
+void OutputFile::flush() {
+    if (file) std::fflush(file);
+}
+
+void OutputFile::close() {
+#ifdef USE_MPI
+    if (shared != MPI_FILE_NULL) MPI_File_close(&shared);
+#endif
+    if (file) std::fclose(file);
+    file = nullptr;
+}
@@ -0,0 +1,110 @@
+#ifndef INC_3DMOLECULARDYNAMICS_DOMAIN_H
+#define INC_3DMOLECULARDYNAMICS_DOMAIN_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#ifdef USE_MPI
+#include <mpi.h>
+#endif
+
+/// Starts MPI for the life of the program when built with it (-DUSE_MPI=ON),
+/// otherwise there is a single process.
+class MpiSession {
+public:
+    MpiSession(int& argc, char**& argv);
+    ~MpiSession();
+
+    int rank() const { return _rank; }
+    int size() const { return _size; }
+
+private:
+    int _rank{0};
+    int _size{1};
+};
+
+/// Splits the periodic box into a px by py grid of rectangular subdomains,
+/// one per process, along the columns and rows of the cell grid.
+///
+/// Each process owns the balls in its block of cells and keeps copies
+/// (ghosts) of the balls in the cells around it, which it gets from the
+/// processes owning them. With a single process the one domain covers the
+/// box and nothing is exchanged.
+class Domain {
+public:
+    Domain();
+
+    int rank() const { return _rank; }
+    int size() const { return _size; }
+    bool distributed() const { return _size > 1; }
+
+    /// Splits an Nx by Ny grid of cells between the processes.
+    void decompose(int Nx, int Ny);
+
+    /// Picks the px by py grid of ranks subdomains, each at most max_px
+    /// and max_py across, with the shortest edges for a width by height box.
+    /// Returns false if there is none.
+    static bool choose_grid(int ranks, double width, double height, int max_px, int max_py, int& px, int& py);
+
+    int px{1}, py{1};
+
+    /// This process's block of cells [x0, x1) by [y0, y1)
+    int x0{0}, x1{0}, y0{0}, y1{0};
+
+    /// Rank owning the cell ix*Ny + iy
+    int owner(int cell) const;
+    bool owns(int cell) const { return !distributed() || owner(cell) == _rank; }
+
+    /// Other ranks owning cells next to this block, each listed once, in
+    /// the order of the buffers of exchange().
+    const std::vector<int>& neighbours() const { return _neighbours; }
+    int neighbour_index(int rank) const;
+
+    /// Sends send[n] to neighbours()[n] and fills recv[n] with what it sent
+    /// here. With sizes_known the recv buffers are already the right size.
+    void exchange(const std::vector<std::vector<double>>& send, std::vector<std::vector<double>>& recv,
+                  bool sizes_known = false) const;
+
+    /// Reductions over every process, which must all call them together
+    bool any(bool value) const;
+    double sum(double value) const;
+    double min(double value) const;
+    double max(double value) const;
+
+    /// Rank 0's value
+    unsigned int broadcast(unsigned int value) const;
+
+    /// Prints message and stops every process.
+    [[noreturn]] void abort(const std::string& message) const;
+
+private:
+    int _rank{0};
+    int _size{1};
+    int Nx{1}, Ny{1};
+    std::vector<int> _neighbours;
+};
+
+/// Output file written by every process together, each process's text
+/// following the last in rank order. A single process writes it as an
+/// ordinary file.
+class OutputFile {
+public:
+    OutputFile() = default;
+    OutputFile(const OutputFile&) = delete;
+    OutputFile& operator=(const OutputFile&) = delete;
+    ~OutputFile();
+
+    void open(const std::string& path, const Domain& domain);
+    void write(const std::string& text);
+    void flush();
+    void close();
+
+private:
+    std::FILE* file{nullptr};
+#ifdef USE_MPI
+    MPI_File shared{MPI_FILE_NULL};
+#endif
+};
+
+
+#endif //INC_3DMOLECULARDYNAMICS_DOMAIN_H
@@ -4,27 +4,110 @@
 
 #include "Engine.h"
 
+#include <atomic>
+#include <cstdarg>
+#include <cstdint>
 #include <memory>
+#include <numeric>
+
+namespace {
+
+    /// printf onto the end of out
+    void appendf(std::string& out, const char* format, ...) {
+        char buffer[256];
+        va_list args;
+        va_start(args, format);
+        int n = std::vsnprintf(buffer, sizeof buffer, format, args);
+        va_end(args);
+        if (n < int(sizeof buffer)) {
+            out.append(buffer, n);
+            return;
+        }
+        size_t start = out.size();
+        out.resize(start + n + 1);
+        va_start(args, format);
+        std::vsnprintf(&out[start], n + 1, format, args);
+        va_end(args);
+        out.resize(start + n);
+    }
+
+    /// Interleaves the bits of x and y, x taking the even bits
+    uint32_t morton_key(uint32_t x, uint32_t y) {
+        auto spread = [](uint32_t v){
+            v &= 0xffff;
+            v = (v | (v << 8)) & 0x00ff00ff;
+            v = (v | (v << 4)) & 0x0f0f0f0f;
+            v = (v | (v << 2)) & 0x33333333;
+            v = (v | (v << 1)) & 0x55555555;
+            return v;
+        };
+        return spread(x) | (spread(y) << 1);
+    }
+
+}
 
 Engine::Engine(Options& options)
-        : _options{options}, lx{options.systemProps.lx}, ly{options.systemProps.ly}, lz{options.systemProps.lz}{
+        : _options{options}, pool{options.programOptions.threads},
+          lx{options.systemProps.lx}, ly{options.systemProps.ly}, lz{options.systemProps.lz}{
     begin = std::chrono::steady_clock::now();
     timestep = options.programOptions.timestep;
-    f1 = fopen(_options.programOptions.savepath.string().c_str(), "w");
-    f3 = fopen(_options.programOptions.csvSavePath.string().c_str(), "w");
-    dump_csv_header(f3);
+    nominal_timestep = timestep;
+    local_timestepping = options.programOptions.local_timestepping;
+    max_sleep = options.programOptions.max_sleep*nominal_timestep;
+    hold_steps = std::max(options.programOptions.slow_force_hold, 1);
+    reorder_interval = options.programOptions.reorder_interval;
+    deterministic = options.programOptions.deterministic;
+    const std::string& huge_pages = options.programOptions.huge_pages;
+    if (huge_pages == "transparent") set_huge_pages(HugePages::transparent);
+    else if (huge_pages == "explicit") set_huge_pages(HugePages::explicit_pages);
+    if (options.programOptions.pin_threads) pin_threads();
+    f1.open(_options.programOptions.savepath.string(), domain);
+    f3.open(_options.programOptions.csvSavePath.string(), domain);
+    std::string header;
+    if (domain.rank() == 0) dump_csv_header(header);
+    f3.write(header);
     if (_options.programOptions.dump_separate){
-        f2 = fopen(_options.programOptions.savepathbase.string().c_str(), "w");
+        f2.open(_options.programOptions.savepathbase.string(), domain);
     }
     init_system();
+    if (huge_pages != "none") std::cout << "Huge pages : " << describe_huge_pages() << std::endl;
+
+    std::string kernel;
+    pair_kernel = select_pair_kernel(options.programOptions.simd, kernel);
+    std::cout << "Ball-ball kernel : " << kernel << std::endl;
+
+    if (options.programOptions.adaptive_timestep) init_adaptive_timestep();
+
+    asleep.assign(no_of_particles, 0);
+    wake_time.assign(no_of_particles, 0);
 
     basePlate.set_zi(_options.systemProps.base_height);
     basePlate.update(0.0);
+    if (_options.programOptions.energy_check) initial_energy = total_energy();
     dump(true);
 }
 
+void Engine::pin_threads() {
+    Topology topology;
+    std::vector<int> cpus = topology.place(pool.size());
+    std::vector<char> pinned(pool.size(), false);
+    pool.run([&](int t){ pinned[t] = pin_this_thread(cpus[t]); });
+    numa_placement = std::all_of(pinned.begin(), pinned.end(), [](char p){ return p; });
+    set_first_touch(numa_placement);
+
+    std::cout << "Topology : " << topology.describe() << std::endl;
+    if (!numa_placement) {
+        std::cout << "Threads : could not be pinned, left to the system" << std::endl;
+        return;
+    }
+    std::cout << "Threads : " << pool.size() << " pinned to CPUs";
+    for (int cpu : cpus) std::cout << " " << cpu << " (node " << topology.node_of(cpu) << ")";
+    std::cout << std::endl;
+}
+
 void Engine::init_system() {
     adjust_box_dimensions();
+    init_cell_grid();
 
     add_particles();
     add_base_particles();
@@ -32,109 +115,364 @@ void Engine::init_system() {
 
     init_lattice_algorithm();
     init_lattice_algorithm_for_base_particles();
+    init_heightfield();
+}
+
+void Engine::init_heightfield() {
+    const std::string& model = _options.programOptions.base_model;
+    if (model == "heightfield") base_model = BaseModel::heightfield;
+    else if (model == "validate") base_model = BaseModel::validate;
+    else base_model = BaseModel::particles;
+
+    // Only the height field models and the benchmark of the two read it
+    if (base_model == BaseModel::particles && _options.programOptions.experiment != "base_benchmark") return;
+
+    // The top of the carpet of base particles is the flat of the surface
+    const SystemProps& sp = _options.systemProps;
+    heightfield = std::make_unique<HeightField>(sp.dimple_spacing, sp.dimple_radius, sp.dimple_depth,
+                                                base_height + r_base, _options.ballProps.radius,
+                                                _options.programOptions.heightfield_resolution);
+    heightfield->calibrate(base_dx, base_dy, r_base);
+    std::cout << "Height field : " << heightfield->bytes() / 1024 << " kB" << std::endl;
+    if (base_model == BaseModel::validate) heightfield_contacts.resize(no_of_particles);
 }
 
 void Engine::dump(bool first) {
     std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
     std::cout << "DUMP Simulation Time : " << Time << " s\t"
-        << "Timestep : " << Time/timestep << "\t"
+        << "Timestep : " << step_number << "\t"
         << "Elapsed time: " << std::chrono::duration_cast<std::chrono::seconds>(now-begin).count() << "s" << std::endl;
 
-    if (step_number >= _options.programOptions.save_delay) {
-
-        dump_preamble(f1, true, !_options.programOptions.dump_separate);
-        dump_particles(f1);
+    bool started = adaptive ? Time >= _options.programOptions.save_delay*nominal_timestep
+                            : step_number >= _options.programOptions.save_delay;
+    std::string text;
+    if (started) {
+        if (domain.rank() == 0) dump_preamble(text, true, !_options.programOptions.dump_separate);
+        dump_particles(text);
     }
     if (!_options.programOptions.dump_separate){
-        dump_base(f1);
+        dump_base(text);
     }
-    std::fflush(f1);
-    std::fflush(f3);
+    f1.write(text);
+    f1.flush();
+    f3.flush();
 
     if (first){
         if (_options.programOptions.dump_separate){
-            dump_preamble(f2, false, true);
-            dump_base(f2);
-            fclose(f2);
+            text.clear();
+            if (domain.rank() == 0) dump_preamble(text, false, true);
+            dump_base(text);
+            f2.write(text);
+            f2.close();
         }
     }
 }
 
-void Engine::dump_preamble(std::FILE *f, bool inc_particles, bool inc_base_particles) const {
+void Engine::dump_preamble(std::string& out, bool inc_particles, bool inc_base_particles) const {
     int N = 0;
-    if (inc_particles) N += no_of_particles;
+    if (inc_particles) N += total_particles;
     if (inc_base_particles) N += no_of_base_particles;
-    std::fprintf(f, "ITEM: TIMESTEP\n%d\n", int(Time / timestep));
-    std::fprintf(f, "ITEM: TIME\n%.8f\n", Time);
-    std::fprintf(f, "ITEM: AMPLITUDE\n%.8f\n", basePlate.A());
-    std::fprintf(f, "ITEM: BOX BOUNDS pp pp f\n%.4f %.4f\n%.4f %.4f\n%.4f %.4f\n", 0.0, lx, 0.0, ly, 0.0, lz);
-    std::fprintf(f, "ITEM: NUMBER OF ATOMS\n%d\n", N);
-    std::fprintf(f, "ITEM: ATOMS x y z vx vy vz radius type\n");
+    appendf(out, "ITEM: TIMESTEP\n%d\n", int(step_number));
+    appendf(out, "ITEM: TIME\n%.8f\n", Time);
+    appendf(out, "ITEM: AMPLITUDE\n%.8f\n", basePlate.A());
+    appendf(out, "ITEM: BOX BOUNDS pp pp f\n%.4f %.4f\n%.4f %.4f\n%.4f %.4f\n", 0.0, lx, 0.0, ly, 0.0, lz);
+    appendf(out, "ITEM: NUMBER OF ATOMS\n%d\n", N);
+    appendf(out, domain.distributed() ? "ITEM: ATOMS id x y z vx vy vz radius type\n"
+                                      : "ITEM: ATOMS x y z vx vy vz radius type\n");
 }
 
-void Engine::dump_csv_header(std::FILE *f) const {
-    std::fprintf(f, "frame,particle,time,x,y,z,vx,vy,vz,radius,type\n");
+void Engine::dump_csv_header(std::string& out) const {
+    appendf(out, "frame,particle,time,x,y,z,vx,vy,vz,radius,type\n");
 }
 
-void Engine::dump_particles(std::FILE *f) {
-    for (Particle& p : particles) {
-        std::fprintf(f, "%.9f %.9f %.9f %.9f %.9f %.9f %.9f %d\n", p.x(), p.y(), p.z(), p.vx(), p.vy(), p.vz(), p.r(), 0);
+void Engine::dump_particles(std::string& out) {
+    const ParticleStore& p = particles;
+    for (size_t n{0}; n < no_of_particles; n++) {
+        size_t i = domain.distributed() ? n : particle_slot[n];
+        if (domain.distributed()) appendf(out, "%d ", original_id[i]);
+        appendf(out, "%.9f %.9f %.9f %.9f %.9f %.9f %.9f %d\n", p.x(i), p.y(i), p.z(i), p.vx(i), p.vy(i), p.vz(i), p.r(i), 0);
     }
 }
 
-void Engine::dump_particle_to_csv(std::FILE *f) {
-    int p_n{0};
-    for (Particle& p : particles){
-        std::fprintf(f, "%d,%d,%.9f,%.9f,%.9f,%.9f,%.9f,%.9f,%.9f,%.9f,%d\n", step_number, p_n, Time, p.x(), p.y(), p.z(), p.vx(), p.vy(), p.vz(), p.r(), 0);
-        p_n++;
+void Engine::dump_particle_to_csv(std::string& out) {
+    const ParticleStore& p = particles;
+    for (size_t p_n{0}; p_n < no_of_particles; p_n++){
+        size_t i = domain.distributed() ? p_n : particle_slot[p_n];
+        appendf(out, "%d,%d,%.9f,%.9f,%.9f,%.9f,%.9f,%.9f,%.9f,%.9f,%d\n", step_number, original_id[i], Time, p.x(i), p.y(i), p.z(i), p.vx(i), p.vy(i), p.vz(i), p.r(i), 0);
     }
 }
 
-void Engine::dump_base(std::FILE *f) {
-    for (Particle &p: base_particles) {
-        std::fprintf(f, "%.9f %.9f %.9f %.9f %.9f %.9f %.9f %d\n", p.x(), p.y(), p.z() + basePlate.z(), p.vx(),
-                     p.vy(), basePlate.vz(), p.r(), 1);
+void Engine::dump_base(std::string& out) {
+    for (int bi{base_i0}; bi < base_i1; bi++) {
+        for (int bj{base_j0}; bj < base_j1; bj++) {
+            size_t k = size_t(bi)*ny_base + bj;
+            Eigen::Vector3d site = base_site(k);
+            if (domain.distributed()) {
+                // Sites in the slices of several processes are written by
+                // the owner of their cell, after the balls in the ids
+                if (!domain.owns(cell_index(site.x(), site.y()))) continue;
+                appendf(out, "%d ", int(total_particles + k));
+            }
+            appendf(out, "%.9f %.9f %.9f %.9f %.9f %.9f %.9f %d\n", site.x(), site.y(), site.z() + basePlate.z(), 0.0,
+                    0.0, basePlate.vz(), r_base, 1);
+        }
     }
 }
 
 void Engine::step() {
-     // Check whether the optimiser needs updating
-     if (ilist_needs_update()) {make_ilist();}
+     scratch.reset();
+
+     // Check whether the optimiser needs updating, only the ball-ball forces
+     // use it so this is done at the steps they are worked out
+     if (step_number % hold_steps == 0) {
+         if (reorder_interval > 0 && step_number >= next_reorder) {
+             reorder_particles();
+             next_reorder = step_number + reorder_interval;
+             make_ilist();
+         }
+         else if (domain.any(ilist_needs_update())) {make_ilist();}
+     }
+     // A ball that wrapped round has to reach the process with the base
+     // lattice under it before its plate forces are worked out
+     else if (domain.distributed() && domain.any(ball_wrapped)) {
+         make_ilist();
+     }
 
      basePlate.update(Time);
 
      integrate();
 
      check_dump();
+     report_stats();
+}
+
+template<typename F>
+void Engine::for_each_ball_block(F&& f) {
+    size_t n_blocks = (no_of_particles + ball_block - 1) / ball_block;
+    auto run_block = [&](int t, size_t block){
+        f(t, block*ball_block, std::min((block + 1)*ball_block, no_of_particles));
+    };
+    // The shares of the last rebuild, unless the balls have changed since
+    if (thread_blocks.size() == size_t(pool.size()) + 1 && thread_blocks.back() == n_blocks) {
+        pool.for_each_task(thread_blocks, run_block);
+    } else {
+        pool.for_each_task(n_blocks, run_block);
+    }
 }
 
 void Engine::integrate() {
-    // Set forces to zero
-    std::for_each(particles.begin(), particles.end(),
-                  [&](Particle& p){
-        p.set_force_to_zero();
-        p.set_torque_to_zero();
-        p.predict(timestep);
+    // Contacts not touched during this step expire
+    contact_epoch++;
+
+    GearCoefficients gear(timestep);
+
+    // The soft ball-ball forces are worked out at the first step of every
+    // hold_steps and held for the rest, while the stiff plate forces are
+    // worked out every step
+    bool evaluating = step_number % hold_steps == 0;
+
+    // Set forces to zero, or to the held ball-ball forces, and predict the
+    // new positions
+    for_each_ball_block([&](int, size_t begin, size_t end){
+        if (evaluating) {
+            particles.set_forces_to_zero(begin, end);
+        } else {
+            std::copy(slow_force.begin() + begin, slow_force.begin() + end, particles.force.begin() + begin);
+            std::copy(slow_torque.begin() + begin, slow_torque.begin() + end, particles.torque.begin() + begin);
+        }
+        particles.predict(gear, begin, end);
     });
 
-    // Calculate all the forces between particles
-    make_forces();
+    // Calculate all the forces between particles, the ghosts moved on to
+    // the predicted positions of their owners first
+    if (evaluating) {
+        if (domain.distributed()) refresh_ghosts();
+        make_forces();
+        if (hold_steps > 1) {
+            slow_force.resize(no_of_particles);
+            slow_torque.resize(no_of_particles);
+            for_each_ball_block([&](int, size_t begin, size_t end){
+                std::copy(particles.force.begin() + begin, particles.force.begin() + end, slow_force.begin() + begin);
+                std::copy(particles.torque.begin() + begin, particles.torque.begin() + end, slow_torque.begin() + begin);
+            });
+        }
+    }
 
     // Calculate all the forces between the particles and the plate
     make_plate_forces();
 
     // Update  the positions of all the particles
-    std::for_each(particles.begin(), particles.end(),
-                  [&](Particle& p){
-            p.correct(timestep, G);
+    // and apply periodic boundary conditions
+    std::atomic<bool> wrapped{false};
+    for_each_ball_block([&](int, size_t begin, size_t end){
+        if (!local_timestepping) {
+            particles.correct(gear, G, begin, end);
+        } else {
+            // The prediction is already exact for sleeping balls, correct
+            // each run of awake ones
+            size_t i{begin};
+            while (i < end) {
+                while (i < end && asleep[i]) i++;
+                size_t run{i};
+                while (i < end && !asleep[i]) i++;
+                if (run < i) particles.correct(gear, G, run, i);
+            }
+        }
+        if (particles.periodic_bc(0, 0, lx, ly, begin, end, ball_wraps.data())) {
+            wrapped.store(true, std::memory_order_relaxed);
+        }
     });
-
-    // Apply periodic boundary conditions
-    std::for_each(particles.begin(), particles.end(),
-                  [&](Particle& p) {p.periodic_bc(0, 0, lx, ly);});
+    if (wrapped && (domain.distributed() || !shift_wrapped_pairs())) ball_wrapped = true;
 
     Time += timestep;
     step_number++;
+
+    if (local_timestepping) update_sleep();
+    if (adaptive) adapt_timestep();
+}
+
+void Engine::run(int steps) {
+    if (!adaptive) {
+        for (int s{0}; s < steps; s++) step();
+        return;
+    }
+    double end = Time + steps*nominal_timestep;
+    while (Time < end) step();
+}
+
+void Engine::update_sleep() {
+    double v_max{0};
+    for (size_t i{0}; i < no_of_particles; i++) {
+        v_max = std::max(v_max, particles.rtd1[i].norm());
+    }
+
+    // Closest neighbour of each ball among the pairs evaluated this step
+    ball_gap.assign(no_of_particles, std::numeric_limits<double>::infinity());
+    for (size_t i{0}; i < no_of_particles; i++) {
+        for (int k{ partner_offsets[i] }; k < partner_offsets[i+1]; k++) {
+            int j = partner_list[k];
+            if (asleep[i] && asleep[j]) continue;
+            ball_gap[i] = std::min(ball_gap[i], pair_gap[k]);
+            ball_gap[j] = std::min(ball_gap[j], pair_gap[k]);
+        }
+    }
+
+    // Two sleeping balls move with a constant relative velocity, so pairs
+    // of them new to the list wake up when they could first touch
+    if (ilist_rebuilt) {
+        for (size_t i{0}; i < no_of_particles; i++) {
+            if (!asleep[i]) continue;
+            for (int k{ partner_offsets[i] }; k < partner_offsets[i+1]; k++) {
+                int j = partner_list[k];
+                if (!asleep[j]) continue;
+                Eigen::Vector3d dr = particles.rtd0[i] - particles.rtd0[j] - shift(partner_shift[k]);
+                double gap = dr.norm() - particles.r(i) - particles.r(j);
+                double closing = (particles.rtd1[i] - particles.rtd1[j]).norm();
+                double touch = gap <= 0 ? Time : Time + gap/closing;
+                wake_time[i] = std::min(wake_time[i], touch);
+                wake_time[j] = std::min(wake_time[j], touch);
+            }
+        }
+        ilist_rebuilt = false;
+    }
+
+    // Time before the gaps are looked at again, with room for the step to grow
+    double horizon = 2*timestep*hold_steps;
+    double g = -G.z();
+    for (size_t i{0}; i < no_of_particles; i++) {
+        double reach = particles.r(i) + r_base + base_z_max;
+        double plate_gap = particles.z(i) - reach - basePlate.z();
+        double speed = particles.rtd1[i].norm() + v_max;
+
+        if (asleep[i]) {
+            sleeping++;
+            // Woken when its time is up, or if anything got closer than
+            // expected (a neighbour sped up, the amplitude went up)
+            double plate_closing = std::abs(particles.vz(i)) + std::abs(basePlate.vz());
+            if (Time >= wake_time[i] || ball_gap[i] < speed*horizon || plate_gap < plate_closing*horizon) {
+                asleep[i] = 0;
+            }
+            continue;
+        }
+
+        if (ball_gap[i] <= 0 || plate_gap <= 0) continue;
+
+        // Time to fall onto the plate at its highest, and for the closest
+        // neighbour to reach it at the fastest speed in the system
+        double h = particles.z(i) - reach - basePlate.top();
+        if (h <= 0) continue;
+        double vz = particles.vz(i);
+        double t_plate = (vz + sqrt(vz*vz + 2*g*h)) / g;
+        double t_neighbour = ball_gap[i] / speed;
+        double flight = std::min({t_plate, t_neighbour, max_sleep});
+        if (flight < 10*horizon) continue;
+
+        // With only gravity acting the predictor is exact
+        asleep[i] = 1;
+        wake_time[i] = Time + flight;
+        particles.rtd2[i] = G;
+        particles.rtd3[i] = null_vec;
+        particles.rot2[i] = null_vec;
+        particles.rot3[i] = null_vec;
+    }
+
+    // Any pair of a sleeper and an awake ball that could close before the
+    // next look, at twice the fastest speed, is evaluated in full
+    wake_reach = 2*v_max*horizon;
+    wake_pairs_within(wake_reach);
+}
+
+void Engine::wake_pairs_within(double reach) {
+    for (size_t i{0}; i < no_of_particles; i++) {
+        for (int k{ partner_offsets[i] }; k < partner_offsets[i+1]; k++) {
+            int j = partner_list[k];
+            // Two sleepers are woken by their wake times
+            if (asleep[i] == asleep[j]) continue;
+            Eigen::Vector3d dr = particles.rtd0[i] - particles.rtd0[j] - shift(partner_shift[k]);
+            if (dr.norm() - particles.r(i) - particles.r(j) < reach) asleep[i] = asleep[j] = 0;
+        }
+    }
+}
+
+void Engine::init_adaptive_timestep() {
+    adaptive = true;
+    steps_per_collision = _options.programOptions.steps_per_collision;
+
+    timestep_min = _options.programOptions.timestep_min;
+    if (timestep_min <= 0) timestep_min = nominal_timestep / 10;
+
+    timestep_max = _options.programOptions.timestep_max;
+    if (timestep_max <= 0) {
+        // Two balls meeting at 1 mm/s, about the gentlest collision there is
+        const ParticleProps& ball = _options.ballProps;
+        double k = 2*ball.youngs_modulus*sqrt(ball.radius)/(3*(1-ball.poisson*ball.poisson));
+        timestep_max = hertz_collision_time(ball.mass/2, k, 1e-3) / steps_per_collision;
+    }
+    timestep_max = std::max(timestep_max, timestep_min);
+    timestep = std::clamp(timestep, timestep_min, timestep_max);
+
+    std::cout << "Adaptive timestep between " << timestep_min << " s and " << timestep_max << " s" << std::endl;
+}
+
+double Engine::contact_step_limit(double m, double k, double A, double xi, double xidot) const {
+    double limit = hertz_collision_time(m, k, impact_speed(m, k, xi, xidot)) / steps_per_collision;
+
+    // The damping force is stiff in the approach speed too. Its explicit
+    // stability limit is 2m/(k A sqrt(xi)) for one contact, a ball in a
+    // packing has several at once.
+    double damping = k*A*std::sqrt(xi);
+    if (damping > 0) limit = std::min(limit, 0.1*m/damping);
+    return limit;
+}
+
+void Engine::adapt_timestep() {
+    // The Gear predictor-corrector keeps the plain time derivatives (velocity,
+    // acceleration and its rate), not derivatives scaled by powers of the
+    // step, so the state carries over to a new step unchanged.
+    double target = domain.min(std::min(pair_step_limit, plate_step_limit));
+
+    // Shrink at once, grow gradually
+    timestep = std::clamp(std::min(target, 1.25*timestep), timestep_min, timestep_max);
 }
 
 
@@ -144,148 +482,1034 @@ void Engine::integrate() {
 /// Lattice Method
 ///////////////////////////////////////////////////////////////////////////////
 
-void Engine::init_lattice_algorithm() {
-    rmin = particles.at(0).r();
-    rmax = particles.at(0).r();
+void Engine::init_cell_grid() {
+    // The grid is laid out before the balls are placed, for the radius of
+    // the ball type. add_particles checks no ball is any larger.
+    rmax = _options.ballProps.radius;
+
+    // Each cell must be at least as wide as the largest interaction range
+    // so that only the 3x3 block of cells around a particle need checking
+    skin = _options.programOptions.verlet_skin;
+    double range = 2*rmax + skin;
+    Nx = std::max(int(lx / range), 1);
+    Ny = std::max(int(ly / range), 1);
+    gkx = lx / Nx;
+    gky = ly / Ny;
+
+    domain.decompose(Nx, Ny);
+    cell_x0 = domain.x0;
+    cell_y0 = domain.y0;
+    cells_x = domain.x1 - domain.x0;
+    cells_y = domain.y1 - domain.y0;
+    cell_start.resize((cells_x + 2)*(cells_y + 2) + 1);
+
+    if (domain.distributed()) {
+        std::cout << "Domains : " << domain.px << " x " << domain.py << " blocks of about "
+            << Nx / domain.px << " x " << Ny / domain.py << " cells" << std::endl;
+        // It keeps state on ghosts that only their owner updates
+        if (local_timestepping) {
+            local_timestepping = false;
+            std::cout << "Local time stepping turned off across processes" << std::endl;
+        }
+    }
+}
 
-    // Calculate gk, the size of the lattice sites
-    gk = sqrt(2) * rmin;
+void Engine::init_lattice_algorithm() {
+    make_ilist();
+}
 
-    // Calcualte gm, the number of lattice sites that the largest particle covers
-    gm = int(2*rmax/gk) + 1;
+int Engine::cell_index(double x, double y) const {
+    int ix = std::clamp(int(x / gkx), 0, Nx - 1);
+    int iy = std::clamp(int(y / gky), 0, Ny - 1);
+    return ix*Ny + iy;
+}
 
-    // calculate the numebr of lattice sites in each dimension
-    Nx = int(lx / gk) + 1;
-    Ny = int(ly / gk + 1);
-    partners.resize(no_of_particles);
-    pindex.resize(Nx);
-    for (auto& p : pindex){
-        p.resize(Ny);
+void Engine::make_cells() {
+    // Calls f(c, code) for each cell of the haloed block holding particle i
+    // or one of its images
+    auto for_each_image = [&](unsigned int i, auto&& f){
+        int ix = particle_cell[i] / Ny, iy = particle_cell[i] % Ny;
+        for (int sx{-1}; sx <= 1; sx++) {
+            int hx = ix - cell_x0 + 1 + sx*Nx;
+            if (hx < 0 || hx > cells_x + 1) continue;
+            for (int sy{-1}; sy <= 1; sy++) {
+                int hy = iy - cell_y0 + 1 + sy*Ny;
+                if (hy < 0 || hy > cells_y + 1) continue;
+                f(hx*(cells_y + 2) + hy, shift_code(sx, sy));
+            }
+        }
+    };
+
+    // Counting sort of the particles, ghosts included, and their images by cell
+    unsigned int n_particles = particles.size();
+    particle_cell.resize(n_particles);
+    int n_cells = (cells_x + 2)*(cells_y + 2);
+    std::fill(cell_start.begin(), cell_start.end(), 0);
+    for (unsigned int i{0}; i < n_particles; i++) {
+        particle_cell[i] = cell_index(particles.x(i), particles.y(i));
+        for_each_image(i, [&](int c, int){ cell_start[c + 1]++; });
     }
-    clear_pindex();
-    make_ilist();
+    for (int c{0}; c < n_cells; c++) {
+        cell_start[c+1] += cell_start[c];
+    }
+    cell_particles.resize(cell_start[n_cells]);
+    cell_shift.resize(cell_start[n_cells]);
+    for (unsigned int i{0}; i < n_particles; i++) {
+        for_each_image(i, [&](int c, int code){
+            cell_shift[cell_start[c]] = (unsigned char)code;
+            cell_particles[cell_start[c]++] = (int)i;
+        });
+    }
+    // Filling advanced each start to the next cell's start, shift back
+    for (int c{n_cells}; c > 0; c--) {
+        cell_start[c] = cell_start[c-1];
+    }
+    cell_start[0] = 0;
+
 }
 
 void Engine::make_ilist() {
-    // For each particle, add it to the pindex lattice site
-    // and clear its partners
-    for (unsigned int i{0}; i<no_of_particles; i++){
-        double x = particles[i].x();
-        double y = particles[i].y();
-        int ix = int(x / gk);
-        int iy = int(y / gk);
-        pindex[ix][iy] = (int)i;
-        partners[i].clear();
-    }
-
-    // Generate the partners list for each particle
+    if (domain.distributed()) migrate_particles();
+    make_cells();
+
+    // Keep the previous list to carry the springs over
+    std::swap(partner_offsets, old_partner_offsets);
+    std::swap(partner_list, old_partner_list);
+    std::swap(partner_springs, old_partner_springs);
+
+    // Calls f(i) for every owned ball, a block of them per task
+    auto for_each_ball = [&](auto&& f){
+        for_each_ball_block([&](int, size_t begin, size_t end){
+            for (size_t i{begin}; i < end; i++) f((unsigned int)i);
+        });
+    };
+
+    // First pass counts the partners of each particle to get the offsets
+    partner_offsets.resize(no_of_particles + 1);
+    partner_offsets[0] = 0;
+    for_each_ball([&](unsigned int i){
+        int n = 0;
+        for_each_candidate(i, [&](int, int){ n++; });
+        partner_offsets[i+1] = n;
+    });
     for (unsigned int i{ 0 }; i < no_of_particles; i++) {
-        double x = particles[i].x();
-        double y = particles[i].y();
-        if ((x >= 0.0) && (x < lx) && (y >= 0.0) && (y < ly)) {
-            int ix = int(x / gk);
-            int iy = int(y / gk);
-            // Check the adjacent gm lattice sites for particles
-            for (int dx = -gm; dx <= gm; dx++) {
-                for (int dy = -gm; dy <= gm; dy++) {
-                    int iix = (ix + dx + Nx) % Nx;
-                    int iiy = (iy + dy + Ny) % Ny;
-                    int k = pindex[iix][iiy];
-                    // Only record the particle once
-                    if (k > (int)i) {
-                        partners[i].push_back(k);
-                    }
+        partner_offsets[i+1] += partner_offsets[i];
+    }
+
+    // Second pass fills in the partners list, each row sorted
+    partner_list.resize(partner_offsets[no_of_particles]);
+    partner_shift.resize(partner_list.size());
+    partner_springs.resize(partner_list.size());
+    if (local_timestepping) {
+        pair_gap.assign(partner_list.size(), 0);
+        ilist_rebuilt = true;
+    }
+    // Rows are sorted on partner and image together, held as k*9 + code
+    // while sorting
+    for_each_ball([&](unsigned int i){
+        int n = partner_offsets[i];
+        for_each_candidate(i, [&](int k, int code){ partner_list[n++] = k*9 + code; });
+        std::sort(partner_list.begin() + partner_offsets[i], partner_list.begin() + n);
+        for (int m{ partner_offsets[i] }; m < n; m++) {
+            partner_shift[m] = (unsigned char)(partner_list[m] % 9);
+            partner_list[m] /= 9;
+        }
+    });
+
+    // Merge the sorted rows of the old and new lists, pairs found in both
+    // keep their spring. The image is left out of the match, as it changes
+    // when a ball wraps round the box. Several images of one partner, only
+    // possible in a box under three cells across, are matched in order.
+    bool have_old = !domain.distributed() && old_partner_offsets.size() == no_of_particles + 1;
+    for_each_ball([&](unsigned int i){
+        int o = have_old ? old_partner_offsets[i] : 0;
+        int o_end = have_old ? old_partner_offsets[i+1] : 0;
+        for (int n{ partner_offsets[i] }; n < partner_offsets[i+1]; n++) {
+            while (o < o_end && old_partner_list[o] < partner_list[n]) o++;
+            if (o < o_end && old_partner_list[o] == partner_list[n]) {
+                partner_springs[n] = old_partner_springs[o++];
+            } else {
+                partner_springs[n] = ContactSpring{};
+            }
+        }
+    });
+
+    // Indices don't last over a rebuild of a distributed run, its springs
+    // are looked up by the original ids of the balls instead
+    if (domain.distributed()) {
+        for_each_ball([&](unsigned int i){
+            for (int n{ partner_offsets[i] }; n < partner_offsets[i+1]; n++) {
+                uint64_t a = original_id[i], b = original_id[partner_list[n]];
+                uint64_t key = std::min(a, b) << 32 | std::max(a, b);
+                auto it = std::lower_bound(carried_springs.begin(), carried_springs.end(), key,
+                                           [](const CarriedSpring& c, uint64_t k){ return c.key < k; });
+                if (it == carried_springs.end() || it->key != key) continue;
+                partner_springs[n] = it->spring;
+                if (a > b) partner_springs[n].elongation = -it->spring.elongation;
+            }
+        });
+        carried_springs.clear();
+    }
+
+    // Counting sort of the pairs by their second ball, for the
+    // deterministic sums
+    if (deterministic) {
+        pair_force.resize(partner_list.size());
+        pair_torque.resize(partner_list.size());
+        incoming_offsets.assign(particles.size() + 1, 0);
+        for (int j : partner_list) incoming_offsets[j + 1]++;
+        for (size_t j{0}; j < particles.size(); j++) {
+            incoming_offsets[j+1] += incoming_offsets[j];
+        }
+        incoming_pairs.resize(partner_list.size());
+        ScratchVector<int> fill(incoming_offsets.begin(), incoming_offsets.end() - 1, ScratchAllocator<int>(scratch));
+        for (size_t k{0}; k < partner_list.size(); k++) {
+            incoming_pairs[fill[partner_list[k]]++] = int(k);
+        }
+    }
+
+    if (skin > 0) {
+        ilist_positions.resize(no_of_particles);
+        for (unsigned int i{0}; i < no_of_particles; i++) {
+            ilist_positions[i] = particles.rtd0[i];
+        }
+    }
+    ball_wraps.assign(no_of_particles, 4);
+    // Pairs new to the list get the same check before they are evaluated,
+    // none sleep before the first step
+    if (local_timestepping && !asleep.empty()) wake_pairs_within(wake_reach);
+    share_balls();
+    if (numa_placement) {
+        // Lay the balls out by the new shares if they have moved off the
+        // ones the arrays were placed by
+        bool shifted = placed_balls.size() != thread_balls.size();
+        for (size_t t{0}; t < thread_balls.size() && !shifted; t++) {
+            size_t a = thread_balls[t], b = placed_balls[t];
+            shifted = std::max(a, b) - std::min(a, b) > ball_block;
+        }
+        if (particles_moved || shifted) {
+            particles.place(pool, thread_balls);
+            placed_balls = thread_balls;
+        }
+    }
+    particles_moved = false;
+    ball_wrapped = false;
+    ilist_rebuilds++;
+}
+
+void Engine::share_balls() {
+    // Cut where the pairs plus the balls before a ball, partner_offsets[i] + i,
+    // reach t/n_threads of the total, a ball's row costing about a pair
+    int n_threads = pool.size();
+    size_t total = partner_offsets[no_of_particles] + no_of_particles;
+    thread_balls.assign(n_threads + 1, no_of_particles);
+    thread_balls[0] = 0;
+    size_t i{0};
+    for (int t{1}; t < n_threads; t++) {
+        size_t target = total * t / n_threads;
+        while (i < no_of_particles && partner_offsets[i] + i < target) i++;
+        thread_balls[t] = i;
+    }
+
+    size_t n_blocks = (no_of_particles + ball_block - 1) / ball_block;
+    thread_blocks.resize(n_threads + 1);
+    for (int t{0}; t <= n_threads; t++) {
+        thread_blocks[t] = std::min((thread_balls[t] + ball_block/2) / ball_block, n_blocks);
+    }
+    thread_blocks[n_threads] = n_blocks;
+}
+
+std::vector<int> Engine::morton_order() const {
+    std::vector<uint32_t> key(no_of_particles);
+    for (size_t i{0}; i < no_of_particles; i++) {
+        int c = cell_index(particles.x(i), particles.y(i));
+        key[i] = morton_key(c / Ny, c % Ny);
+    }
+    std::vector<int> order(no_of_particles);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b){ return key[a] < key[b]; });
+    return order;
+}
+
+void Engine::reorder_particles() {
+    // Indices don't last over a rebuild of a distributed run anyway, the
+    // balls are sorted as they are exchanged
+    if (domain.distributed()) {
+        sort_on_migrate = true;
+        return;
+    }
+
+    std::vector<int> order = morton_order();
+    ScratchVector<int> rank(no_of_particles, ScratchAllocator<int>(scratch));
+    for (size_t n{0}; n < no_of_particles; n++) rank[order[n]] = int(n);
+
+    particles.permute(order);
+    particles_moved = true;
+    permute(base_contacts, order);
+    if (!heightfield_contacts.empty()) permute(heightfield_contacts, order);
+    permute(asleep, order);
+    permute(wake_time, order);
+    permute(original_id, order);
+    for (size_t n{0}; n < no_of_particles; n++) particle_slot[original_id[n]] = int(n);
+
+    // Move the partners list over to the new indices so that make_ilist
+    // carries the springs over. A spring and the image shift are measured
+    // from the first ball of the pair, so they change sign when the pair
+    // turns round.
+    struct Entry {
+        int partner;
+        int shift;
+        ContactSpring spring;
+    };
+    ScratchVector<int> offsets(no_of_particles + 1, 0, ScratchAllocator<int>(scratch));
+    for (size_t i{0}; i < no_of_particles; i++) {
+        for (int k{ partner_offsets[i] }; k < partner_offsets[i+1]; k++) {
+            offsets[std::min(rank[i], rank[partner_list[k]]) + 1]++;
+        }
+    }
+    for (size_t n{0}; n < no_of_particles; n++) offsets[n+1] += offsets[n];
+
+    ScratchVector<Entry> entries(partner_list.size(), ScratchAllocator<Entry>(scratch));
+    ScratchVector<int> fill(offsets.begin(), offsets.end() - 1, ScratchAllocator<int>(scratch));
+    for (size_t i{0}; i < no_of_particles; i++) {
+        for (int k{ partner_offsets[i] }; k < partner_offsets[i+1]; k++) {
+            int a = rank[i], b = rank[partner_list[k]];
+            int code = partner_shift[k];
+            ContactSpring spring = partner_springs[k];
+            if (a > b) {
+                std::swap(a, b);
+                code = 8 - code;
+                spring.elongation = -spring.elongation;
+            }
+            entries[fill[a]++] = {b, code, spring};
+        }
+    }
+    for (size_t n{0}; n < no_of_particles; n++) {
+        std::sort(entries.begin() + offsets[n], entries.begin() + offsets[n+1],
+                  [](const Entry& a, const Entry& b){
+                      return a.partner < b.partner || (a.partner == b.partner && a.shift < b.shift);
+                  });
+    }
+
+    partner_offsets.assign(offsets.begin(), offsets.end());
+    for (size_t k{0}; k < entries.size(); k++) {
+        partner_list[k] = entries[k].partner;
+        partner_shift[k] = (unsigned char)entries[k].shift;
+        partner_springs[k] = entries[k].spring;
+    }
+}
+
+template<typename F>
+void Engine::for_each_candidate(unsigned int i, F&& f) const {
+    // The halo puts every cell around a real cell on the grid
+    int hx = particle_cell[i] / Ny - cell_x0 + 1;
+    int hy = particle_cell[i] % Ny - cell_y0 + 1;
+    for (int dx = -1; dx <= 1; dx++) {
+        for (int dy = -1; dy <= 1; dy++) {
+            int c = (hx + dx)*(cells_y + 2) + hy + dy;
+            for (int n{cell_start[c]}; n < cell_start[c+1]; n++) {
+                int k = cell_particles[n];
+                int code = cell_shift[n];
+                // Only record the pair once
+                if (k > (int)i && (skin == 0 || in_skin(i, k, code))) {
+                    f(k, code);
                 }
             }
         }
     }
 }
 
+bool Engine::in_skin(unsigned int i, unsigned int k, int code) const {
+    Eigen::Vector3d s = shift(code);
+    double dx = particles.x(i) - particles.x(k) - s.x();
+    double dy = particles.y(i) - particles.y(k) - s.y();
+    double dz = particles.z(i) - particles.z(k);
+    double cutoff = particles.r(i) + particles.r(k) + skin;
+    return dx*dx + dy*dy + dz*dz < cutoff*cutoff;
+}
+
+bool Engine::shift_wrapped_pairs() {
+    // A ball moved by the boxes wi keeps its place in the pairs if the image
+    // of j in a pair (i, j) moves by wi - wj
+    std::atomic<bool> followed{true};
+    for_each_ball_block([&](int, size_t begin, size_t end){
+        for (size_t i{begin}; i < end; i++) {
+            int wi = ball_wraps[i];
+            for (int k{ partner_offsets[i] }; k < partner_offsets[i+1]; k++) {
+                int wj = ball_wraps[partner_list[k]];
+                if (wi == 4 && wj == 4) continue;
+                int code = partner_shift[k];
+                int sx = code / 3 - 1 + wi / 3 - wj / 3;
+                int sy = code % 3 - 1 + wi % 3 - wj % 3;
+                if (wi > 8 || wj > 8 || std::abs(sx) > 1 || std::abs(sy) > 1) {
+                    followed.store(false, std::memory_order_relaxed);
+                    continue;
+                }
+                partner_shift[k] = (unsigned char)shift_code(sx, sy);
+            }
+        }
+    });
+    for_each_ball_block([&](int, size_t begin, size_t end){
+        std::fill(ball_wraps.begin() + begin, ball_wraps.begin() + end, 4);
+    });
+    return followed;
+}
+
 bool Engine::ilist_needs_update() {
-    // If the pindex is the same as last time then it doesn't need updating
+    // The images the pairs were found with are out of date
+    if (ball_wrapped) return true;
+
+    if (skin > 0) {
+        // Rebuild once any particle could have closed half the skin
+        double max_disp2 = 0;
+        for (unsigned int i{ 0 }; i < no_of_particles; i++) {
+            double dx = normalize(particles.x(i) - ilist_positions[i].x(), lx);
+            double dy = normalize(particles.y(i) - ilist_positions[i].y(), ly);
+            double dz = particles.z(i) - ilist_positions[i].z();
+            max_disp2 = std::max(max_disp2, dx*dx + dy*dy + dz*dz);
+        }
+        return max_disp2 > 0.25*skin*skin;
+    }
+
+    // If every particle is in the same cell as last time then it doesn't need updating
     for (unsigned int i{ 0 }; i < no_of_particles; i++) {
-        double x = particles[i].x();
-        double y = particles[i].y();
-        int ix = int(x / gk);
-        int iy = int(y/ gk);
-        if (pindex.at(ix).at(iy) != i) {
-            clear_pindex();
+        if (cell_index(particles.x(i), particles.y(i)) != particle_cell[i]) {
             return true;
         }
     }
     return false;
 }
 
-void Engine::clear_pindex()
-{
-    for (auto& p : pindex) {
-        for (auto& q : p) {
-            q = -1;
+///////////////////////////////////////////////////////////////////////////////
+/// Domain decomposition
+///////////////////////////////////////////////////////////////////////////////
+
+void Engine::migrate_particles() {
+    size_t n_neighbours = domain.neighbours().size();
+    send_buffers.assign(n_neighbours, {0});
+
+    // Neighbour each owned ball goes to, -1 if it stays
+    ScratchVector<int> destination(no_of_particles, -1, ScratchAllocator<int>(scratch));
+    std::vector<int> keep;
+    for (size_t i{0}; i < no_of_particles; i++) {
+        int owner = domain.owner(cell_index(particles.x(i), particles.y(i)));
+        if (owner == domain.rank()) {
+            keep.push_back(int(i));
+            continue;
+        }
+        destination[i] = domain.neighbour_index(owner);
+        if (destination[i] < 0) domain.abort("A ball moved more than a cell between rebuilds");
+    }
+
+    // Each buffer holds the number of balls, the balls and then the springs
+    // of the pairs they are in. Between the ball-ball force evaluations
+    // the held forces go along too
+    bool validating = base_model == BaseModel::validate;
+    bool holding = step_number % hold_steps != 0;
+    for (size_t i{0}; i < no_of_particles; i++) {
+        if (destination[i] < 0) continue;
+        std::vector<double>& out = send_buffers[destination[i]];
+        out[0]++;
+        out.push_back(original_id[i]);
+        out.push_back(particles.type[i]);
+        for (auto* v : {&particles.rtd0, &particles.rtd1, &particles.rtd2, &particles.rtd3,
+                        &particles.rot0, &particles.rot1, &particles.rot2, &particles.rot3}) {
+            const Eigen::Vector3d& r = (*v)[i];
+            out.insert(out.end(), {r.x(), r.y(), r.z()});
+        }
+        base_contacts[i].pack(out);
+        if (validating) heightfield_contacts[i].pack(out);
+        if (holding) {
+            out.insert(out.end(), {slow_force[i].x(), slow_force[i].y(), slow_force[i].z()});
+            out.insert(out.end(), {slow_torque[i].x(), slow_torque[i].y(), slow_torque[i].z()});
+        }
+    }
+
+    // Live springs are kept by original id, and go along with a ball
+    // leaving for another process
+    carried_springs.clear();
+    if (partner_offsets.size() == no_of_particles + 1) {
+        for (size_t i{0}; i < no_of_particles; i++) {
+            for (int k{ partner_offsets[i] }; k < partner_offsets[i+1]; k++) {
+                int j = partner_list[k];
+                ContactSpring spring = partner_springs[k];
+                if (spring.expired(pair_epoch + 1)) continue;
+                uint64_t a = original_id[i], b = original_id[j];
+                if (a > b) {
+                    std::swap(a, b);
+                    spring.elongation = -spring.elongation;
+                }
+                carried_springs.push_back({a << 32 | b, spring});
+
+                int to_i = destination[i];
+                int to_j = size_t(j) < no_of_particles ? destination[j] : -1;
+                for (int to : {to_i, to_j == to_i ? -1 : to_j}) {
+                    if (to < 0) continue;
+                    send_buffers[to].insert(send_buffers[to].end(),
+                                            {double(a), double(b), spring.elongation.x(), spring.elongation.y(),
+                                             spring.elongation.z(), double(spring.epoch)});
+                }
+            }
+        }
+    }
+
+    // Drop the balls that left and the ghosts, and add the arrivals
+    particles.permute(keep);
+    particles_moved = true;
+    permute(base_contacts, keep);
+    if (validating) permute(heightfield_contacts, keep);
+    permute(original_id, keep);
+    if (holding) {
+        permute(slow_force, keep);
+        permute(slow_torque, keep);
+    }
+
+    domain.exchange(send_buffers, recv_buffers);
+    for (const std::vector<double>& buffer : recv_buffers) {
+        const double* in = buffer.data();
+        const double* end = in + buffer.size();
+        size_t arrivals = size_t(*in++);
+        for (size_t n{0}; n < arrivals; n++) {
+            original_id.push_back(int(in[0]));
+            size_t i = particles.add(0, 0, 0, int(in[1]));
+            in += 2;
+            for (auto* v : {&particles.rtd0, &particles.rtd1, &particles.rtd2, &particles.rtd3,
+                            &particles.rot0, &particles.rot1, &particles.rot2, &particles.rot3}) {
+                (*v)[i] = Eigen::Vector3d(in[0], in[1], in[2]);
+                in += 3;
+            }
+            in = base_contacts.emplace_back().unpack(in);
+            if (validating) in = heightfield_contacts.emplace_back().unpack(in);
+            if (holding) {
+                slow_force.emplace_back(in[0], in[1], in[2]);
+                slow_torque.emplace_back(in[3], in[4], in[5]);
+                in += 6;
+            }
+        }
+        for (; in < end; in += 6) {
+            ContactSpring spring{Eigen::Vector3d(in[2], in[3], in[4]), (unsigned int)in[5]};
+            carried_springs.push_back({uint64_t(in[0]) << 32 | uint64_t(in[1]), spring});
+        }
+    }
+    no_of_particles = particles.size();
+    std::sort(carried_springs.begin(), carried_springs.end(),
+              [](const CarriedSpring& a, const CarriedSpring& b){ return a.key < b.key; });
+
+    if (sort_on_migrate) {
+        std::vector<int> order = morton_order();
+        particles.permute(order);
+        permute(base_contacts, order);
+        if (validating) permute(heightfield_contacts, order);
+        permute(original_id, order);
+        if (holding) {
+            permute(slow_force, order);
+            permute(slow_torque, order);
+        }
+        sort_on_migrate = false;
+    }
+
+    exchange_ghosts();
+}
+
+void Engine::exchange_ghosts() {
+    size_t n_neighbours = domain.neighbours().size();
+    ghost_send.resize(n_neighbours);
+    for (std::vector<int>& sent : ghost_send) sent.clear();
+    send_buffers.assign(n_neighbours, {});
+
+    for (size_t i{0}; i < no_of_particles; i++) {
+        int c = cell_index(particles.x(i), particles.y(i));
+        int ix = c / Ny, iy = c % Ny;
+        // Only the cells along the edge of the block are next to others
+        if (ix > cell_x0 && ix < cell_x0 + cells_x - 1 && iy > cell_y0 && iy < cell_y0 + cells_y - 1) continue;
+
+        // Sent once to each process owning a cell around it, which places
+        // whichever of its images it needs
+        int sent_to[8];
+        int n_sent{0};
+        for (int dx{-1}; dx <= 1; dx++) {
+            for (int dy{-1}; dy <= 1; dy++) {
+                int owner = domain.owner(((ix + dx + Nx) % Nx)*Ny + (iy + dy + Ny) % Ny);
+                if (owner == domain.rank() || std::find(sent_to, sent_to + n_sent, owner) != sent_to + n_sent) {
+                    continue;
+                }
+                sent_to[n_sent++] = owner;
+                int n = domain.neighbour_index(owner);
+                ghost_send[n].push_back(int(i));
+                const Eigen::Vector3d& r = particles.rtd0[i];
+                const Eigen::Vector3d& v = particles.rtd1[i];
+                const Eigen::Vector3d& w = particles.rot1[i];
+                send_buffers[n].insert(send_buffers[n].end(), {double(original_id[i]), double(particles.type[i]),
+                                                               r.x(), r.y(), r.z(), v.x(), v.y(), v.z(),
+                                                               w.x(), w.y(), w.z()});
+            }
+        }
+    }
+
+    domain.exchange(send_buffers, recv_buffers);
+    ghost_begin.resize(n_neighbours + 1);
+    for (size_t n{0}; n < n_neighbours; n++) {
+        ghost_begin[n] = particles.size();
+        const std::vector<double>& buffer = recv_buffers[n];
+        for (size_t b{0}; b < buffer.size(); b += 11) {
+            original_id.push_back(int(buffer[b]));
+            size_t g = particles.add(buffer[b + 2], buffer[b + 3], buffer[b + 4], int(buffer[b + 1]));
+            particles.rtd1[g] = Eigen::Vector3d(buffer[b + 5], buffer[b + 6], buffer[b + 7]);
+            particles.rot1[g] = Eigen::Vector3d(buffer[b + 8], buffer[b + 9], buffer[b + 10]);
+        }
+    }
+    ghost_begin[n_neighbours] = particles.size();
+}
+
+void Engine::refresh_ghosts() {
+    // The ghosts come in the order they were sent at the rebuild
+    size_t n_neighbours = ghost_send.size();
+    send_buffers.resize(n_neighbours);
+    recv_buffers.resize(n_neighbours);
+    for (size_t n{0}; n < n_neighbours; n++) {
+        send_buffers[n].clear();
+        for (int i : ghost_send[n]) {
+            for (auto* v : {&particles.rtd0, &particles.rtd1, &particles.rot1}) {
+                const Eigen::Vector3d& r = (*v)[i];
+                send_buffers[n].insert(send_buffers[n].end(), {r.x(), r.y(), r.z()});
+            }
+        }
+        recv_buffers[n].resize(9*(ghost_begin[n+1] - ghost_begin[n]));
+    }
+
+    domain.exchange(send_buffers, recv_buffers, true);
+    for (size_t n{0}; n < n_neighbours; n++) {
+        const double* in = recv_buffers[n].data();
+        for (size_t g{ghost_begin[n]}; g < ghost_begin[n+1]; g++) {
+            for (auto* v : {&particles.rtd0, &particles.rtd1, &particles.rot1}) {
+                (*v)[g] = Eigen::Vector3d(in[0], in[1], in[2]);
+                in += 3;
+            }
         }
     }
 }
 
 void Engine::make_forces() {
-    // Loop over the partners list for each particle
-    for (unsigned int i{ 0 }; i < no_of_particles; i++) {
-        std::set<size_t> contacts;
-        for (unsigned int k{ 0 }; k < partners[i].size(); k++) {
-            int pk = partners[i][k];
-            bool contact = force(particles[i], particles[pk], _options.systemProps.lx, _options.systemProps.ly, _options.systemProps.lz, timestep);
-            if (contact) contacts.insert(pk);
+    // Pair springs have their own epoch as they are only touched when the
+    // forces are worked out, and stretch over the whole hold
+    pair_epoch++;
+    double held_step = timestep * hold_steps;
+
+    int n_threads = pool.size();
+    thread_force.resize(n_threads - 1);
+    thread_torque.resize(n_threads - 1);
+    thread_step_limit.assign(n_threads, std::numeric_limits<double>::infinity());
+    thread_used.assign(n_threads, false);
+
+    // Each thread works through its own share of the balls, cut by the
+    // number of pairs, never stolen ones, so which buffer a pair is added
+    // into, and the rounding of the sums, only depends on the number of
+    // threads. Thread 0 adds straight onto the particles, the other threads
+    // into their own buffers. In deterministic mode every pair is written
+    // to its own place instead.
+    pool.run([&](int t){
+        size_t begin = thread_balls[t], end = thread_balls[t+1];
+        if (begin == end) return;
+        PlacedVector<Eigen::Vector3d>& F = t == 0 ? particles.force : thread_force[t-1];
+        PlacedVector<Eigen::Vector3d>& T = t == 0 ? particles.torque : thread_torque[t-1];
+        if (t > 0 && !deterministic) {
+            F.assign(particles.size(), null_vec);
+            T.assign(particles.size(), null_vec);
+        }
+        thread_used[t] = true;
+
+        // Pairs are gathered into lanes of a batch, and the results of
+        // each batch added on in pair order
+        PairBatch batch{};
+        int lane_i[PairBatch::max_width], lane_j[PairBatch::max_width], lane_k[PairBatch::max_width];
+        int lanes{0};
+
+        auto flush = [&]{
+            for (int l{lanes}; l < PairBatch::max_width; l++) {
+                batch.dx[l] = batch.dy[l] = batch.dz[l] = 0;
+                batch.r1[l] = batch.r2[l] = 0;
+            }
+            pair_kernel(batch, held_step);
+            for (int l{0}; l < lanes; l++) {
+                if (local_timestepping) pair_gap[lane_k[l]] = -batch.xi[l];
+                if (!(batch.contact & (1u << l))) {
+                    if (deterministic) pair_force[lane_k[l]] = pair_torque[lane_k[l]] = null_vec;
+                    continue;
+                }
+                int i = lane_i[l], j = lane_j[l];
+                ContactSpring& spring = partner_springs[lane_k[l]];
+                spring.elongation = {batch.sx[l], batch.sy[l], batch.sz[l]};
+                spring.epoch = pair_epoch;
+                Eigen::Vector3d f{batch.fx[l], batch.fy[l], batch.fz[l]};
+                Eigen::Vector3d tq{batch.tx[l], batch.ty[l], batch.tz[l]};
+                // The pair torque goes on the ball with the lower original id
+                // and minus it on the other, however the balls are ordered now
+                if (original_id[i] > original_id[j]) tq = -tq;
+                if (deterministic) {
+                    pair_force[lane_k[l]] = f;
+                    pair_torque[lane_k[l]] = tq;
+                } else {
+                    F[i] += f;
+                    F[j] -= f;
+                    T[i] += tq;
+                    T[j] -= tq;
+                }
+
+                if (adaptive) {
+                    double m = particles.mass[i]*particles.mass[j]/(particles.mass[i] + particles.mass[j]);
+                    double k = particles.hertz_constant[particles.type[i]]*sqrt(particles.radius[i]);
+                    double limit = contact_step_limit(m, k, batch.damping[l], batch.xi[l], batch.xidot[l]);
+                    thread_step_limit[t] = std::min(thread_step_limit[t], limit);
+                }
+            }
+            lanes = 0;
+        };
+
+        // Fills lane l with balls i and j, the pair at k in the partners list
+        auto fill = [&](int l, int i, int j, int k){
+            int ti = particles.type[i];
+            const ParticleProps& m = particles.types[ti];
+            lane_i[l] = i;
+            lane_j[l] = j;
+            lane_k[l] = k;
+
+            // j's image sits at its position plus the shift, seen from i
+            Eigen::Vector3d dr = particles.rtd0[i] - particles.rtd0[j] - shift(partner_shift[k]);
+            Eigen::Vector3d dv = particles.rtd1[i] - particles.rtd1[j];
+            Eigen::Vector3d w = particles.radius[i]*particles.rot1[i] + particles.radius[j]*particles.rot1[j];
+            batch.dx[l] = dr.x(); batch.dy[l] = dr.y(); batch.dz[l] = dr.z();
+            batch.dvx[l] = dv.x(); batch.dvy[l] = dv.y(); batch.dvz[l] = dv.z();
+            batch.wx[l] = w.x(); batch.wy[l] = w.y(); batch.wz[l] = w.z();
+            batch.r1[l] = particles.radius[i];
+            batch.r2[l] = particles.radius[j];
+            batch.kappa[l] = particles.hertz_constant[ti];
+            batch.damping[l] = m.damping_factor;
+            batch.gamma[l] = m.tangential_damping;
+            batch.mu[l] = m.friction;
+
+            const ContactSpring& spring = partner_springs[k];
+            Eigen::Vector3d s = spring.expired(pair_epoch) ? null_vec : spring.elongation;
+            batch.sx[l] = s.x(); batch.sy[l] = s.y(); batch.sz[l] = s.z();
+        };
+
+        for (size_t i{begin}; i < end; i++) {
+            for (int k{ partner_offsets[i] }; k < partner_offsets[i+1]; k++) {
+                int j = partner_list[k];
+                // Sleeping balls can't touch each other
+                if (local_timestepping && asleep[i] && asleep[j]) {
+                    if (deterministic) pair_force[k] = pair_torque[k] = null_vec;
+                    continue;
+                }
+                fill(lanes++, int(i), j, k);
+                if (lanes == PairBatch::max_width) flush();
+            }
         }
-        particles[i].update_particle_contacts(contacts);
+        if (lanes > 0) flush();
+    });
+    if (adaptive) pair_step_limit = *std::min_element(thread_step_limit.begin(), thread_step_limit.end());
+
+    // Each ball adds up its own pairs, then the pairs it is the second ball
+    // of, each in list order
+    if (deterministic) {
+        for_each_ball_block([&](int, size_t begin, size_t end){
+            for (size_t i{begin}; i < end; i++) {
+                for (int k{ partner_offsets[i] }; k < partner_offsets[i+1]; k++) {
+                    particles.force[i] += pair_force[k];
+                    particles.torque[i] += pair_torque[k];
+                }
+                for (int n{ incoming_offsets[i] }; n < incoming_offsets[i+1]; n++) {
+                    particles.force[i] -= pair_force[incoming_pairs[n]];
+                    particles.torque[i] -= pair_torque[incoming_pairs[n]];
+                }
+            }
+        });
+        return;
+    }
+
+    // Add on the buffers of the other threads that had tasks, in thread
+    // order
+    if (n_threads > 1) {
+        for_each_ball_block([&](int, size_t begin, size_t end){
+            for (size_t i{begin}; i < end; i++) {
+                for (int t{0}; t < n_threads - 1; t++) {
+                    if (!thread_used[t + 1]) continue;
+                    particles.force[i] += thread_force[t][i];
+                    particles.torque[i] += thread_torque[t][i];
+                }
+            }
+        });
     }
 }
 
 void Engine::make_plate_forces() {
-    for (auto& p: particles){
-            std::set<size_t> contacts;
-            double x = p.x();
-            double y = p.y();
-            int ix = int(x / gk_base);
-            int iy = int(y / gk_base);
-            for (int dx = -gm_base; dx <= gm_base; dx++) {
-                for (int dy = -gm_base; dy <= gm_base; dy++) {
-                    int iix = (ix + dx + nx_base) % (nx_base);
-                    int iiy = (iy + dy + ny_base) % (ny_base);
-                    int k = pindex_base[iix][iiy];
-                    if (k>=0) {
-                        bool contact = force(p, base_particles.at(k), basePlate, timestep);
-                        if (contact) contacts.insert(k);
+    // A task is a block of balls, each ball only adds onto its own force
+    plate_tallies.assign(pool.size(), PlateTally{});
+    for_each_ball_block([&](int thread, size_t begin, size_t end){
+        PlateTally& tally = plate_tallies[thread];
+        for (size_t i{begin}; i < end; i++){
+            if (local_timestepping && asleep[i]) continue;
+
+            // Gap between the ball and the reach of the highest site
+            double gap = particles.z(i) - basePlate.z() - base_z_max - (particles.r(i) + r_base);
+            bool touching = false;
+
+            // Balls above the reach of the highest site can't touch the base,
+            // their old base contacts expire by epoch
+            if (gap >= 0) {
+                tally.culled++;
+            } else {
+                tally.tested++;
+                Eigen::Vector3d f, t;
+                double xi, xidot;
+                auto add_contact = [&]{
+                    particles.force[i] += f;
+                    particles.torque[i] += t;
+                    touching = true;
+
+                    if (adaptive) {
+                        const ParticleProps& mb = _options.baseProps;
+                        double m = particles.mass[i];
+                        double kn = base_force_constant(particles.props(i), mb, particles.r(i));
+                        if (base_model == BaseModel::heightfield) kn *= heightfield->stiffening(xi);
+                        double A = 0.5*(particles.props(i).damping_factor + mb.damping_factor);
+                        tally.step_limit = std::min(tally.step_limit, contact_step_limit(m, kn, A, xi, xidot));
+                    }
+                };
+
+                if (base_model == BaseModel::heightfield) {
+                    if (force(particles, i, *heightfield, _options.baseProps, basePlate, timestep, base_contacts[i],
+                              contact_epoch, f, t, xi, xidot)) {
+                        add_contact();
                     }
+                } else {
+                    Eigen::Vector3d lattice_force{null_vec};
+                    for_each_base_site_in_reach(i, [&](size_t k){
+                        if (force(particles, i, base_site(k), _options.baseProps, k, basePlate, timestep, base_contacts[i],
+                                  contact_epoch, f, t, xi, xidot)) {
+                            add_contact();
+                            lattice_force += f;
+                        }
+                    });
+                    if (base_model == BaseModel::validate) validate_heightfield(i, touching, lattice_force, tally);
                 }
             }
-            p.update_base_contacts(contacts);
+
+            // A ball closing on the base fast enough to reach it within the
+            // longest step sets the step before it lands
+            if (adaptive && !touching) {
+                double closing = basePlate.vz() - particles.vz(i);
+                if (closing > 0 && std::max(gap, 0.0) < closing*timestep_max) {
+                    double m = particles.mass[i];
+                    double kn = base_force_constant(particles.props(i), _options.baseProps, particles.r(i));
+                    tally.step_limit = std::min(tally.step_limit, hertz_collision_time(m, kn, closing) / steps_per_collision);
+                }
+            }
+        }
+    });
+
+    plate_step_limit = std::numeric_limits<double>::infinity();
+    for (const PlateTally& tally : plate_tallies) {
+        plate_culled += tally.culled;
+        plate_tested += tally.tested;
+        plate_step_limit = std::min(plate_step_limit, tally.step_limit);
+        validated += tally.validated;
+        validate_mismatched += tally.mismatched;
+        validate_difference += tally.difference;
+        validate_force += tally.force;
+        validate_max_difference = std::max(validate_max_difference, tally.max_difference);
     }
 }
 
-void Engine::check_dump() {
-    if (step_number <= _options.programOptions.save_delay){
-        if (save != 1000){
-            save++;
-        } else {
-            save = 1;
-            dump(false);
+void Engine::validate_heightfield(size_t i, bool touching, const Eigen::Vector3d& lattice_force, PlateTally& tally) {
+    Eigen::Vector3d f{null_vec}, t;
+    double xi, xidot;
+    bool field_touching = force(particles, i, *heightfield, _options.baseProps, basePlate, timestep,
+                                heightfield_contacts[i], contact_epoch, f, t, xi, xidot);
+    if (!touching && !field_touching) return;
+
+    if (!field_touching) f = null_vec;
+    tally.validated++;
+    if (touching != field_touching) tally.mismatched++;
+    double difference = (f - lattice_force).norm();
+    tally.difference += difference;
+    tally.force += lattice_force.norm();
+    tally.max_difference = std::max(tally.max_difference, difference);
+}
+
+void Engine::benchmark_base_models(int repeats) {
+    BaseModel model = base_model;
+    for (BaseModel m : {BaseModel::particles, BaseModel::heightfield}) {
+        base_model = m;
+        plate_tested = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int r{0}; r < repeats; r++) {
+            contact_epoch++;
+            make_plate_forces();
         }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "BENCH Base model : " << (m == BaseModel::particles ? "particles" : "heightfield") << "\t"
+            << "Plate force pass : " << 1e6*seconds/repeats << " us\t"
+            << "Balls tested per second : " << plate_tested/seconds << std::endl;
     }
-    else {
-        if (save != _options.programOptions.save_interval) {
-            save++;
-        } else {
-            dump(false);
-            save = 1;
+    base_model = model;
+    plate_tested = 0;
+}
+
+void Engine::benchmark_steps(int steps) {
+    auto start = std::chrono::steady_clock::now();
+    run(steps);
+    double seconds = domain.max(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    double balls = domain.sum(no_of_particles);
+    std::cout << "BENCH Processes : " << domain.size() << " (" << domain.px << " x " << domain.py << ")\t"
+        << "Balls : " << size_t(balls) << "\t"
+        << "Balls per process : " << size_t(domain.min(no_of_particles)) << "-"
+        << size_t(domain.max(no_of_particles)) << "\t"
+        << "Step : " << 1e6*seconds/steps << " us\t"
+        << "Ball steps per second per process : " << balls*steps/seconds/domain.size() << std::endl;
+}
+
+template<typename F>
+void Engine::for_each_base_site_in_reach(size_t p, F&& f) const {
+    double reach = particles.r(p) + r_base;
+
+    // Vertical distance from the ball to the nearest height a site can have
+    double h = particles.z(p) - basePlate.z();
+    double dz = 0;
+    if (h > base_z_max) dz = h - base_z_max;
+    else if (h < base_z_min) dz = base_z_min - h;
+
+    // Only sites inside this disc around the ball can be in contact
+    double R2 = reach*reach - dz*dz;
+    if (R2 <= 0) return;
+    for_each_base_site_in_disc(particles.x(p), particles.y(p), R2, f);
+}
+
+template<typename F>
+void Engine::for_each_base_site_in_disc(double x, double y, double R2, F&& f) const {
+    double R = sqrt(R2);
+    int j_min = std::max(int(ceil((y - R) / base_dy)), base_j0);
+    int j_max = std::min(int(floor((y + R) / base_dy)), base_j1 - 1);
+    for (int j{j_min}; j <= j_max; j++) {
+        // Half width of the disc along row j
+        double ry = y - double(j)*base_dy;
+        double c2 = R2 - ry*ry;
+        if (c2 < 0) continue;
+        double c = sqrt(c2);
+        double row_offset = double(j%2)*base_dx/2.0;
+        int i_min = std::max(int(ceil((x - c - row_offset) / base_dx)), base_i0);
+        int i_max = std::min(int(floor((x + c - row_offset) / base_dx)), base_i1 - 1);
+        for (int i{i_min}; i <= i_max; i++) {
+            f(size_t(i)*ny_base + j);
         }
+    }
+}
 
-        if (save_csv != _options.programOptions.csv_interval){
-            save_csv++;
-        } else {
-            dump_particle_to_csv(f3);
-            save_csv = 1;
+void Engine::report_stats() {
+    if (step_number % 1000 != 0) return;
+    std::cout << "STATS Step : " << step_number << "\t"
+        << "Neighbour list rebuilds per 1000 steps : " << ilist_rebuilds << "\t"
+        << "Balls culled/tested against base per step : "
+        << domain.sum(plate_culled) / 1000.0 << "/" << domain.sum(plate_tested) / 1000.0 << std::endl;
+    if (local_timestepping) {
+        std::cout << "STATS Step : " << step_number << "\t"
+            << "Balls asleep per step : " << sleeping / 1000.0 << std::endl;
+    }
+    if (base_model == BaseModel::validate && domain.sum(validated) > 0) {
+        std::cout << "VALIDATE Step : " << step_number << "\t"
+            << "Ball contacts compared : " << (unsigned long)domain.sum(validated) << "\t"
+            << "In one model only : " << (unsigned long)domain.sum(validate_mismatched) << "\t"
+            << "Mean |F_field - F_particles| / |F_particles| : "
+            << domain.sum(validate_difference) / domain.sum(validate_force) << "\t"
+            << "Max |F_field - F_particles| : " << domain.max(validate_max_difference) << " N" << std::endl;
+        validated = 0;
+        validate_mismatched = 0;
+        validate_difference = 0;
+        validate_force = 0;
+        validate_max_difference = 0;
+    }
+    ilist_rebuilds = 0;
+    plate_culled = 0;
+    plate_tested = 0;
+    sleeping = 0;
+
+    if (_options.programOptions.energy_check) {
+        double energy = total_energy();
+        std::cout << "ENERGY Step : " << step_number << "\t"
+            << "Total energy : " << energy << " J\t"
+            << "Relative drift : " << (energy - initial_energy) / std::abs(initial_energy) << std::endl;
+    }
+}
+
+double Engine::total_energy() const {
+    double energy{0};
+    for (size_t i{0}; i < no_of_particles; i++) {
+        energy += 0.5*particles.mass[i]*particles.rtd1[i].squaredNorm()
+                + 0.5*particles.inertia[i]*particles.rot1[i].squaredNorm()
+                - particles.mass[i]*G.dot(particles.rtd0[i]);
+    }
+
+    // Elastic energy of the Hertz contacts, 2/5 of the force times the overlap.
+    // Pairs with a ghost are counted by both processes, half each.
+    for (size_t i{0}; i < no_of_particles; i++) {
+        double r1 = particles.r(i);
+        double force_constant = particles.hertz_constant[particles.type[i]]*sqrt(r1);
+        for (int k{ partner_offsets[i] }; k < partner_offsets[i+1]; k++) {
+            int j = partner_list[k];
+            Eigen::Vector3d dr = particles.rtd0[i] - particles.rtd0[j] - shift(partner_shift[k]);
+            double xi = r1 + particles.r(j) - dr.norm();
+            double share = size_t(j) < no_of_particles ? 0.4 : 0.2;
+            if (xi > 0) energy += share*force_constant*xi*xi*sqrt(xi);
+        }
+        if (base_model == BaseModel::heightfield) {
+            double Z;
+            Eigen::Vector3d n;
+            heightfield->sample(particles.x(i), particles.y(i), Z, n);
+            double xi = (basePlate.z() + Z - particles.z(i))*n.z();
+            double base_constant = base_force_constant(particles.props(i), _options.baseProps, r1);
+            if (xi > 0) energy += base_constant*heightfield->work(xi);
+            continue;
+        }
+        for_each_base_site_in_reach(i, [&](size_t k){
+            Eigen::Vector3d site = base_site(k);
+            Eigen::Vector3d dr{particles.x(i) - site.x(), particles.y(i) - site.y(),
+                               particles.z(i) - (basePlate.z() + site.z())};
+            double xi = r1 + r_base - dr.norm();
+            double base_constant = base_force_constant(particles.props(i), _options.baseProps, r1);
+            if (xi > 0) energy += 0.4*base_constant*xi*xi*sqrt(xi);
+        });
+    }
+    return domain.sum(energy);
+}
+
+void Engine::check_dump() {
+    bool delaying = adaptive ? Time <= _options.programOptions.save_delay*nominal_timestep
+                             : step_number <= _options.programOptions.save_delay;
+    if (delaying){
+        if (save_due(next_delay_save_time, 1000)) dump(false);
+    }
+    else {
+        if (save_due(next_save_time, _options.programOptions.save_interval)) dump(false);
+        if (save_due(next_csv_time, _options.programOptions.csv_interval)) {
+            std::string text;
+            dump_particle_to_csv(text);
+            f3.write(text);
         }
     }
 }
 
+bool Engine::save_due(double& next_time, int interval) {
+    if (interval <= 0) return false;
+    if (!adaptive) return step_number % interval == 0;
+
+    // Intervals are the physical time of that many nominal timesteps, the
+    // next save is at the next multiple of it
+    double period = interval*nominal_timestep;
+    if (next_time < 0) next_time = (std::floor(Time / period) + 1)*period;
+    if (Time < next_time) return false;
+    next_time = (std::floor(Time / period) + 1)*period;
+    return true;
+}
+
 
 void Engine::add_particles() {
     double r = _options.ballProps.radius;
@@ -294,25 +1518,40 @@ void Engine::add_particles() {
     int nx = floor(lx / dx) - 1;
     int ny = floor(ly / dy) - 1;
 
+    // Every process draws the same balls and keeps the ones in its block
     std::random_device rd;
-    std::default_random_engine eng(rd());
+    unsigned int seed = domain.broadcast(_options.programOptions.seed > 0 ? _options.programOptions.seed : rd());
+    std::cout << "Seed : " << seed << std::endl;
+    std::default_random_engine eng(seed);
     std::uniform_real_distribution<> distr(0.0, 1.0);
 
-    size_t index = 0;
+    int ball_type = particles.add_type(_options.ballProps);
+    int id{0};
     for (int i{0}; i < nx; i++){
         for (int j{0}; j < ny; j++){
             double x = double(i)*dx + double(j%2)*dx/2.0;
             double y = double(j)*dy;
             double z = _options.systemProps.ball_height;
-            Particle pp(x, y, z, index, _options.ballProps);
             double area_fraction = _options.systemProps.area_fraction;
             if (distr(eng) < area_fraction) {
-                particles.push_back(pp);
-                index++;
+                if (domain.owns(cell_index(x, y))) {
+                    particles.add(x, y, z, ball_type);
+                    original_id.push_back(id);
+                }
+                id++;
             }
         }
     }
     no_of_particles = particles.size();
+    total_particles = id;
+
+    // The 3x3 cells around a ball only hold all its contacts if the cells
+    // are at least the largest diameter plus the skin across
+    double largest{0};
+    for (size_t i{0}; i < no_of_particles; i++) largest = std::max(largest, particles.r(i));
+    if (domain.max(largest) > rmax) domain.abort("A ball is larger than the cells were sized for");
+    base_contacts.resize(no_of_particles);
+    particle_slot = original_id;
 }
 
 void Engine::add_base_particles() {
@@ -322,86 +1561,78 @@ void Engine::add_base_particles() {
 
     int nx = floor(lx / dx);
     int ny = floor(ly / dy);
-    size_t index = 0;
-    for (int i{0}; i <= nx; i++){
-        for (int j{0}; j <= ny; j++){
-            double x = double(i)*dx + double(j%2)*dx/2.0;
-            double y = double(j)*dy;
-            double z = _options.systemProps.base_height;
-            Particle pp(x, y, z, index, _options.baseProps);
-            base_particles.push_back(pp);
-            index++;
-        }
+    // Site (i, j) has index i*ny_base + j, for_each_base_site_in_reach relies on it
+    base_dx = dx;
+    base_dy = dy;
+    nx_base = nx + 1;
+    ny_base = ny + 1;
+    no_of_base_particles = size_t(nx_base)*ny_base;
+    base_height = _options.systemProps.base_height;
+    dimple_depth = _options.systemProps.dimple_depth;
+
+    // A distributed run keeps the part of the lattice under its block, a
+    // cell either side for balls that have strayed out of it since the last
+    // rebuild, and the contact reach
+    base_i0 = 0;
+    base_i1 = nx_base;
+    base_j0 = 0;
+    base_j1 = ny_base;
+    if (domain.distributed()) {
+        double margin = rmax + r;
+        double x_lo = (cell_x0 - 1)*gkx - margin, x_hi = (cell_x0 + cells_x + 1)*gkx + margin;
+        double y_lo = (cell_y0 - 1)*gky - margin, y_hi = (cell_y0 + cells_y + 1)*gky + margin;
+        base_i0 = std::max(int(floor(x_lo / dx)) - 1, 0);
+        base_i1 = std::min(int(ceil(x_hi / dx)) + 1, nx_base);
+        base_j0 = std::max(int(floor(y_lo / dy)) - 1, 0);
+        base_j1 = std::min(int(ceil(y_hi / dy)) + 1, ny_base);
     }
-    no_of_base_particles = base_particles.size();
+    dimpled.assign(size_t(base_i1 - base_i0)*(base_j1 - base_j0), false);
 }
 
 
 
 void Engine::init_lattice_algorithm_for_base_particles() {
-    r_base = base_particles.at(0).r();
-    gk_base = sqrt(2)*r_base;
-    gm_base = int(2*particles.at(0).r()/gk+1);
-    nx_base = int(lx/gk_base)+1;
-    ny_base = int(ly/gk_base)+1;
-
-    pindex_base.resize(nx_base);
-    for (auto & px : pindex_base){
-        px.resize(ny_base);
-    }
-    clear_pindex_base();
-
-    for (int i=0; i<base_particles.size(); i++) {
-        double x = base_particles[i].x();
-        double y = base_particles[i].y();
-        int ix = int(x/gk_base);
-        int iy = int(y/gk_base);
-        pindex_base.at(ix).at(iy)=i;
-    }
-}
-
-void Engine::clear_pindex_base() {
-    for (auto &px: pindex_base) {
-        for (auto &py: px) {
-            py = -1;
-        }
+    r_base = _options.baseProps.radius;
+
+    // Range of site heights once the dimples have been carved
+    base_z_min = base_height;
+    base_z_max = base_height;
+    if (domain.any(std::find(dimpled.begin(), dimpled.end(), true) != dimpled.end())) {
+        base_z_min = std::min(base_z_min, base_height - dimple_depth);
+        base_z_max = std::max(base_z_max, base_height - dimple_depth);
     }
 }
 
 void Engine::create_dimples() {
-
-    // Make kd tree of base particles
-    my_vector_of_vectors_t tree_input;
-    for (auto &p: base_particles) {
-        tree_input.push_back({p.x(), p.y()});
-    }
-    const size_t dims{2};
-    auto tree = my_kd_tree_t{dims, tree_input, 10};
-    tree.index->buildIndex();
-
-
     double L = _options.systemProps.dimple_spacing;
     double dx = L;
     double dy = L * sqrt(3) / 2;
+    double radius = _options.systemProps.dimple_radius;
 
+    // Stamp each dimple onto the lattice sites under it. The walk covers a
+    // lattice spacing more than the dimple so that rounding in its row and
+    // column ranges can't drop sites on the edge. Only the dimples over
+    // this process's slice of the lattice are stamped.
+    double walk = radius + base_dx;
     int nx = ceil(lx / dx);
     int ny = ceil(ly / dy);
-    for (int i{0}; i <= nx; i++) {
-        for (int j{0}; j <= ny; j++) {
+    int i_min = std::max(int(floor((base_i0*base_dx - walk) / dx)) - 1, 0);
+    int i_max = std::min(int(ceil((base_i1*base_dx + walk) / dx)), nx);
+    int j_min = std::max(int(floor((base_j0*base_dy - walk) / dy)), 0);
+    int j_max = std::min(int(ceil((base_j1*base_dy + walk) / dy)), ny);
+    for (int i{i_min}; i <= i_max; i++) {
+        for (int j{j_min}; j <= j_max; j++) {
             double x = double(i) * dx + double(j % 2) * dx / 2.0;
             double y = double(j) * dy;
-            const double query_pt[2] = {x, y};
-
-            std::vector<std::pair<size_t, double>> ret_matches;
-            nanoflann::SearchParams params;
-            const size_t nMatches = tree.index->radiusSearch(&query_pt[0], _options.systemProps.dimple_radius*_options.systemProps.dimple_radius,
-                                                             ret_matches, params);
-            for (int n{0}; n < nMatches; n++) {
-                size_t index = ret_matches[n].first;
-                base_particles[index].set_z(-_options.systemProps.dimple_depth);
-            }
+            for_each_base_site_in_disc(x, y, walk*walk, [&](size_t k){
+                Eigen::Vector3d site = base_site(k);
+                double ex = x - site.x();
+                double ey = y - site.y();
+                // Dimples are spaced further apart than their diameter, so a
+                // site is in at most one of them
+                if (ex*ex + ey*ey < radius*radius) dimpled[slice_index(k)] = true;
+            });
         }
-
     }
 }
 
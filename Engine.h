@@ -5,23 +5,26 @@
 #ifndef INC_3DMOLECULARDYNAMICS_ENGINE_H
 #define INC_3DMOLECULARDYNAMICS_ENGINE_H
 
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <fstream>
 #include <filesystem>
 #include <vector>
+#include <limits>
 #include "Particle.h"
 #include "BasePlate.h"
 #include <random>
 #include <chrono>
 #include "Options.h"
-#include "nanoflann.h"
-#include "KDTreeVectorOfVectorsAdaptor.h"
+#include "ThreadPool.h"
+#include "ForceKernel.h"
+#include "Domain.h"
+#include "Topology.h"
+#include "Memory.h"
 #include <Eigen/Dense>
-#include <set>
-
-typedef  std::vector<std::vector<double>> my_vector_of_vectors_t;
-typedef KDTreeVectorOfVectorsAdaptor<my_vector_of_vectors_t, double> my_kd_tree_t;
+#include <memory>
 
 namespace fs = std::filesystem;
 
@@ -41,8 +44,23 @@ public:
      ///Iterates the simulation by one timestep
      void step();
 
+     /// Runs steps timesteps, or in adaptive mode the physical time of
+     /// steps nominal timesteps.
+     void run(int steps);
+
      void set_baseplate(double A, double T){basePlate.set_A(A); basePlate.set_T(T);}
 
+     double time() const {return Time;}
+
+     /// Times repeated plate force passes with the base particles and with
+     /// the height field on the current configuration. The passes pile up
+     /// forces and springs, so this ends a run.
+     void benchmark_base_models(int repeats);
+
+     /// Times steps timesteps and reports the time per step and the ball
+     /// steps per second of each process, for weak scaling runs.
+     void benchmark_steps(int steps);
+
 private:
     /// Setup the system
 
@@ -70,65 +88,298 @@ private:
     /// Lattice algorithm for balls
     /////////////////////////////////////////////////////////////////////////////
 
-    /// 2D vector representing the lattice cells
-    /// Value contains -1 if empty or the index of the particle.
-    std::vector<std::vector<int>> pindex;
+    /// Cell list over this process's cells_x by cells_y block of the Nx by
+    /// Ny grid of columns, starting at cell (cell_x0, cell_y0), with a halo
+    /// of ghost cells around it, (cells_x+2) by (cells_y+2) cells in all.
+    /// Cell c = hx*(cells_y+2) + hy holds cell_particles[cell_start[c]] up
+    /// to cell_particles[cell_start[c+1]], any number of particles per cell,
+    /// with the shift code of the image in the same place in cell_shift.
+    /// The ghost cells hold the images of the particles next to the block,
+    /// from across the box or from other processes, so the cells around any
+    /// real cell are found without wrapping. A single process has the whole
+    /// grid.
+    PagedVector<int> cell_start;
+    PagedVector<int> cell_particles;
+    PagedVector<unsigned char> cell_shift;
+
+    /// Cell of each particle at the last rebuild, ix*Ny + iy on the whole
+    /// grid without the halo.
+    PagedVector<int> particle_cell;
+    int cell_x0{0}, cell_y0{0}, cells_x{0}, cells_y{0};
+
+    /// Image of a particle moved by sx boxes along x and sy along y, each
+    /// -1, 0 or 1, has shift code (sx+1)*3 + sy+1. Code 4 is no shift and
+    /// the image of the opposite shift has code 8 - code.
+    static int shift_code(int sx, int sy) { return (sx + 1)*3 + sy + 1; }
+    Eigen::Vector3d shift(int code) const {
+        return {double(code / 3 - 1)*lx, double(code % 3 - 1)*ly, 0};
+    }
+
+    /// Neighbours of particle i are partner_list[partner_offsets[i]] up to
+    /// partner_list[partner_offsets[i+1]], in increasing order. The
+    /// tangential spring of each pair and the shift code of the image of the
+    /// partner it is with sit at the same position in partner_springs and
+    /// partner_shift. A partner is listed once per image in reach, which is
+    /// only ever more than once in boxes under three cells across. All
+    /// vectors keep their capacity between rebuilds.
+    PagedVector<int> partner_offsets;
+    PagedVector<int> partner_list;
+    PagedVector<unsigned char> partner_shift;
+    PagedVector<ContactSpring> partner_springs;
+
+    /// The list from the previous rebuild, springs are carried over from it
+    PagedVector<int> old_partner_offsets;
+    PagedVector<int> old_partner_list;
+    PagedVector<ContactSpring> old_partner_springs;
+
+    /// Updates the cell list and the partners list.
+    void make_ilist();
 
-    /// Vector containing a list of neighbours for each particle.
-    std::vector<std::vector<int>> partners;
+    /// Sorts the particles into the cell list.
+    void make_cells();
 
+    /// Calls f(k, code) for every image of a partner k > i found in the
+    /// cells around i, code being the shift code of the image.
+    template<typename F>
+    void for_each_candidate(unsigned int i, F&& f) const;
 
-    /// Updates pindex and partners.
-    void make_ilist();
+    /// Whether particle i and the image of k with shift code are within the
+    /// contact distance plus the skin.
+    bool in_skin(unsigned int i, unsigned int k, int code) const;
 
-    /// Checks if pindex will change.
+    /// Checks if any particle has changed cell, or in Verlet mode whether any
+    /// particle has moved more than half the skin since the last rebuild.
+    /// A wrap the pairs couldn't follow needs a rebuild too.
     bool ilist_needs_update();
-    void clear_pindex();
+
+    /// Set when a particle moved round the box and the list has to be
+    /// rebuilt for it: always across processes, where the ball may belong
+    /// to another one, and when shift_wrapped_pairs couldn't follow it
+    bool ball_wrapped{false};
+
+    /// Shift code of the boxes each owned ball was moved by in periodic_bc
+    /// this step, 4 for none. shift_wrapped_pairs moves the images of the
+    /// pairs of those balls with them, so a wrap on its own doesn't need a
+    /// rebuild, and returns false if an image would go past the next box.
+    PagedVector<unsigned char> ball_wraps;
+    bool shift_wrapped_pairs();
+
+    /// Sizes the cell grid and splits it between the processes
+    void init_cell_grid();
     void init_lattice_algorithm();
+    int cell_index(double x, double y) const;
+
+    double rmax{0}, gkx{0}, gky{0};
+    int Nx{0}, Ny{0};
+
+    /// Verlet skin added to the contact distance when building the partners list.
+    double skin{0};
+
+    /// Positions at the last rebuild of the partners list (Verlet mode only).
+    std::vector<Eigen::Vector3d> ilist_positions;
+
+    /// Number of partners list rebuilds since the last report.
+    unsigned int ilist_rebuilds{0};
+
+    /////////////////////////////////////////////////////////////////////////////
+    /// Particle ordering
+    /////////////////////////////////////////////////////////////////////////////
+
+    /// Sorts the balls along a Morton (Z-order) curve through their cells,
+    /// so that balls close in space are close in memory, and moves everything
+    /// indexed by ball over. The partners list must be rebuilt afterwards.
+    void reorder_particles();
+
+    /// Order of the owned balls along the Morton curve, balls in the same
+    /// cell keeping their order
+    std::vector<int> morton_order() const;
+
+    /// Steps between reorders, 0 for never, and the step of the next one
+    int reorder_interval{0};
+    unsigned int next_reorder{0};
+
+    /// Original id of each ball, and where each original id is now. Balls
+    /// are written out by original id.
+    std::vector<int> original_id;
+    std::vector<int> particle_slot;
+
+    /////////////////////////////////////////////////////////////////////////////
+    /// Domain decomposition
+    /////////////////////////////////////////////////////////////////////////////
+
+    // A distributed run keeps the balls it owns at indices up to
+    // no_of_particles and the ghosts after them. Ghosts only take part in
+    // the ball-ball forces, as the partner of an owned ball, and the forces
+    // worked out on them are thrown away: their owner works out the same
+    // pair from its side. Ownership only changes at a rebuild.
+
+    Domain domain;
+
+    /// Hands the balls that have left this block to the processes that now
+    /// own them, along with their springs, then fetches the ghosts. Called
+    /// by make_ilist in a distributed run.
+    void migrate_particles();
+
+    /// Sends the balls in the cells next to each neighbour's block to it,
+    /// and adds the ones received as ghosts.
+    void exchange_ghosts();
+
+    /// Brings the ghosts up to date with their owners, before each
+    /// evaluation of the ball-ball forces.
+    void refresh_ghosts();
+
+    /// Owned balls sent to each neighbour as ghosts, and where the ghosts
+    /// from each neighbour start, the last entry being the end
+    std::vector<std::vector<int>> ghost_send;
+    std::vector<size_t> ghost_begin;
+    std::vector<std::vector<double>> send_buffers, recv_buffers;
+
+    /// Pair springs of a distributed run kept over a rebuild, by the
+    /// original ids of the two balls (smaller first) and seen from the
+    /// smaller id's side, sorted by key. Indices don't last over a rebuild.
+    struct CarriedSpring {
+        uint64_t key;
+        ContactSpring spring;
+    };
+    std::vector<CarriedSpring> carried_springs;
+
+    /// Set by reorder_particles in a distributed run, the next migration
+    /// sorts the owned balls
+    bool sort_on_migrate{false};
+
+    /// Balls in the whole system
+    size_t total_particles{0};
 
-    double rmin{0}, rmax{0}, gk{0};
-    int gm{0}, Nx{0}, Ny{0};
     /////////////////////////////////////////////////////////////////////////////
     /// Lattice algorithm for base
     /////////////////////////////////////////////////////////////////////////////
 
-    /// 2D vector representing the lattice cells for base particles
-    /// Value contains -1 if empty or the index of the particle
-    std::vector<std::vector<int>> pindex_base;
+    /// The base sites form a hexagonal lattice of nx_base columns and ny_base
+    /// rows, site (i, j) sits at (i*base_dx + (j%2)*base_dx/2, j*base_dy).
+    /// Sites aren't stored, only whether each one is in a dimple. A process
+    /// only keeps the columns [base_i0, base_i1) and rows [base_j0, base_j1)
+    /// its balls can reach.
 
     void init_lattice_algorithm_for_base_particles();
-    void clear_pindex_base();
 
+    /// Calls f(k) for every base site k close enough to touch p, found from
+    /// the lattice rows and columns under its contact footprint.
+    template<typename F>
+    void for_each_base_site_in_reach(size_t p, F&& f) const;
+
+    /// Calls f(k) for every base site k within sqrt(R2) of (x, y) in the plane.
+    template<typename F>
+    void for_each_base_site_in_disc(double x, double y, double R2, F&& f) const;
+
+    /// Balls skipped by the height check and balls checked against the
+    /// lattice, summed over the steps since the last report.
+    unsigned long plate_culled{0}, plate_tested{0};
+
+    /// What one thread of make_plate_forces counted, added onto the totals
+    /// once the phase is over
+    struct alignas(64) PlateTally {
+        unsigned long culled{0}, tested{0};
+        double step_limit{std::numeric_limits<double>::infinity()};
+        unsigned long validated{0}, mismatched{0};
+        double difference{0}, force{0}, max_difference{0};
+    };
+    std::vector<PlateTally> plate_tallies;
+
+    double r_base{0}, base_dx{0}, base_dy{0};
+    double base_z_min{0}, base_z_max{0};
+    int nx_base{0}, ny_base{0};
+    int base_i0{0}, base_i1{0}, base_j0{0}, base_j1{0};
+
+    /// Position of site k = i*ny_base + j in the slice
+    size_t slice_index(size_t k) const {
+        size_t i = k / ny_base, j = k % ny_base;
+        return (i - base_i0)*(base_j1 - base_j0) + j - base_j0;
+    }
+
+    /// Position of site k relative to the plate
+    Eigen::Vector3d base_site(size_t k) const {
+        size_t i = k / ny_base, j = k % ny_base;
+        double z = dimpled[slice_index(k)] ? base_height - dimple_depth : base_height;
+        return {double(i)*base_dx + double(j%2)*base_dx/2.0, double(j)*base_dy, z};
+    }
+
+    /////////////////////////////////////////////////////////////////////////////
+    /// Height field model of the base
+    /////////////////////////////////////////////////////////////////////////////
 
-    double r_base{0}, gk_base{0};
-    int gm_base{0}, nx_base{0}, ny_base{0};
+    /// Contact model of the plate: the lattice of base particles, the height
+    /// field, or the lattice with the height field checked against it.
+    enum class BaseModel { particles, heightfield, validate };
+    BaseModel base_model{BaseModel::particles};
+
+    /// Builds the height field, left null with the lattice model unless the
+    /// base_benchmark experiment needs it
+    void init_heightfield();
+    std::unique_ptr<HeightField> heightfield;
+
+    /// Works out the height field force on ball i next to the lattice force,
+    /// with its own springs, and adds up the differences in tally.
+    void validate_heightfield(size_t i, bool touching, const Eigen::Vector3d& lattice_force, PlateTally& tally);
+    PagedVector<ContactHistory> heightfield_contacts;
+    unsigned long validated{0}, validate_mismatched{0};
+    double validate_difference{0}, validate_force{0}, validate_max_difference{0};
+
+    /// One bit per site of the slice, set if the site is sunk by dimple_depth
+    std::vector<bool> dimpled;
+    double base_height{0}, dimple_depth{0};
 
     ///////////////////////////////////////////////////////////
     /// File saving
     //////////////////////////////////////////////////////////
 
+    // Each process formats its own balls and base sites, the first one
+    // adds the preamble. A distributed run writes the original id of each
+    // one first, as they come in no particular order.
     void dump(bool first);
-    void dump_preamble(std::FILE* f, bool inc_particles, bool inc_base_particles) const;
-    void dump_csv_header(std::FILE* f) const;
-    void dump_particles(std::FILE* f);
-    void dump_particle_to_csv(std::FILE* f);
-    void dump_base(std::FILE * f);
+    void dump_preamble(std::string& out, bool inc_particles, bool inc_base_particles) const;
+    void dump_csv_header(std::string& out) const;
+    void dump_particles(std::string& out);
+    void dump_particle_to_csv(std::string& out);
+    void dump_base(std::string& out);
     void check_dump();
-    int save{1};
-    int save_csv{1};
-    std::FILE* f1;
-    std::FILE* f2;
-    std::FILE* f3;
+    void report_stats();
+
+    /// Says if a save every interval steps, or in adaptive mode every
+    /// interval nominal timesteps of physical time, is due. Saves fall on
+    /// whole multiples of the interval, each cadence keeping its own
+    /// next_time, so the saves after the delay don't depend on it.
+    bool save_due(double& next_time, int interval);
+    double next_delay_save_time{-1};
+    double next_save_time{-1};
+    double next_csv_time{-1};
+
+    /// Kinetic, rotational, gravitational and Hertz elastic energy of the
+    /// balls. Only conserved without damping and friction and with the
+    /// plate at rest, which makes it a check on the integrator.
+    double total_energy() const;
+    double initial_energy{0};
+    OutputFile f1;
+    OutputFile f2;
+    OutputFile f3;
 
     ///////////////////////////////////////////////////////////
     /// Particle data
     //////////////////////////////////////////////////////////
 
-    std::vector<Particle> particles;
+    ParticleStore particles;
     size_t no_of_particles{0};
-    std::vector<Particle> base_particles;
     size_t no_of_base_particles{0};
 
+    /// Tangential springs of each ball's contacts with base particles
+    PagedVector<ContactHistory> base_contacts;
+
+    /// Advanced once per step, springs not touched in the previous epoch
+    /// are restarted
+    unsigned int contact_epoch{1};
+
+    /// Advanced once per ball-ball force evaluation, for the pair springs
+    unsigned int pair_epoch{1};
+
 
 
     ///////////////////////////////////////////////////////////
@@ -137,8 +388,133 @@ private:
 
     Options _options;
 
+    /// Workers shared by every parallel phase of the step
+    ThreadPool pool;
+
+    /// Pins the threads to CPUs spread over the NUMA nodes, thread 0 on the
+    /// first, and reports the topology. Once pinned, the balls' arrays are
+    /// placed (ParticleStore::place) by thread_balls whenever they have been
+    /// rearranged or the shares have moved by more than a ball block, so
+    /// each thread's share is on its own node.
+    void pin_threads();
+    bool numa_placement{false};
+    bool particles_moved{true};
+
+    /// Temporaries of the rebuilds and reorders, given back at the start of
+    /// every step. Only used by the main thread.
+    ScratchArena scratch;
+
+    /// Runs f(thread, begin, end) on blocks of ball_block owned balls as
+    /// tasks of the pool, each thread starting on its thread_blocks share.
+    /// Every phase but make_forces splits the balls this way.
+    template<typename F>
+    void for_each_ball_block(F&& f);
+    static constexpr size_t ball_block{512};
+
+    /// Owned balls thread_balls[t] up to thread_balls[t+1] are thread t's
+    /// share of make_forces, cut by share_balls at each rebuild so each
+    /// share holds about as many pairs plus balls. The shares only depend
+    /// on the partners list and the number of threads. thread_blocks are
+    /// the same shares in ball blocks, where each thread starts in
+    /// for_each_ball_block, and placed_balls the shares the particles were
+    /// last placed by.
+    std::vector<size_t> thread_balls;
+    std::vector<size_t> thread_blocks;
+    std::vector<size_t> placed_balls;
+    void share_balls();
+
+    /// Per-thread force and torque buffers of make_forces, for threads 1 and
+    /// up, and whether each thread had any balls to fill its buffer with
+    std::vector<PlacedVector<Eigen::Vector3d>> thread_force;
+    std::vector<PlacedVector<Eigen::Vector3d>> thread_torque;
+    std::vector<char> thread_used;
+
+    /// In deterministic mode make_forces keeps the force and torque of each
+    /// pair on its first ball at the pair's place in the partners list, and
+    /// each ball then adds up its own pairs in list order, whatever the
+    /// number of threads. The second ball of the pairs in
+    /// incoming_pairs[incoming_offsets[i]] up to incoming_pairs[incoming_offsets[i+1]]
+    /// is i, in increasing order.
+    bool deterministic{false};
+    PagedVector<Eigen::Vector3d> pair_force, pair_torque;
+    PagedVector<int> incoming_offsets;
+    PagedVector<int> incoming_pairs;
+
+    /// Steps each ball-ball force evaluation is held for, and the held
+    /// forces and torques when above 1. Holding a force, rather than
+    /// splitting it into kicks as RESPA does, isn't symplectic, so the
+    /// energy drifts more the longer the hold.
+    int hold_steps{1};
+    PlacedVector<Eigen::Vector3d> slow_force, slow_torque;
+
+    /// Batched ball-ball contact kernel for this CPU's instruction set
+    PairKernel pair_kernel{nullptr};
+
     double timestep{0};
 
+    ///////////////////////////////////////////////////////////
+    /// Adaptive timestep
+    //////////////////////////////////////////////////////////
+
+    void init_adaptive_timestep();
+
+    /// Picks the next timestep from the step limits of the contacts seen.
+    void adapt_timestep();
+
+    /// Longest step for a contact of reduced mass m, force constant k and
+    /// damping factor A at overlap xi closing at xidot.
+    double contact_step_limit(double m, double k, double A, double xi, double xidot) const;
+
+    /// Timestep from the options, the unit of the dump and run intervals
+    double nominal_timestep{0};
+
+    bool adaptive{false};
+    double steps_per_collision{50};
+    double timestep_min{0}, timestep_max{0};
+
+    /// Shortest step limit among the ball-ball contacts at the last
+    /// evaluation and among the base contacts (or imminent ones) this step
+    double pair_step_limit{std::numeric_limits<double>::infinity()};
+    double plate_step_limit{std::numeric_limits<double>::infinity()};
+    std::vector<double> thread_step_limit;
+
+    ///////////////////////////////////////////////////////////
+    /// Local time stepping
+    //////////////////////////////////////////////////////////
+
+    /// Puts balls clear of the plate and their neighbours to sleep until
+    /// they could first touch something, and wakes those whose time is up.
+    /// Sleeping balls fly ballistically: the predictor moves them, and
+    /// their plate forces, pairs with other sleepers and corrector are
+    /// skipped.
+    void update_sleep();
+
+    /// Wakes both balls of every pair of a sleeper and an awake ball with a
+    /// gap under reach, so a sleeper never misses the force of a contact.
+    /// Run at the end of update_sleep and on every new partners list, with
+    /// wake_reach, how far a pair could close before the next update.
+    void wake_pairs_within(double reach);
+    double wake_reach{0};
+
+    bool local_timestepping{false};
+
+    /// Longest flight, in physical time
+    double max_sleep{0};
+
+    std::vector<unsigned char> asleep;
+    std::vector<double> wake_time;
+
+    /// Gap of each pair at its last evaluation, by partner list position,
+    /// and the smallest gap of each ball
+    std::vector<double> pair_gap;
+    std::vector<double> ball_gap;
+
+    /// Set by make_ilist so update_sleep checks pairs of sleepers new to the list
+    bool ilist_rebuilt{false};
+
+    /// Sleeping balls summed over the steps since the last report
+    unsigned long sleeping{0};
+
     double Time{0};
     unsigned int step_number{0};
     Eigen::Vector3d G{0, 0, -9.81};
@@ -0,0 +1,55 @@
+#include "ForceKernel.h"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+    /// One lane at a time, for CPUs without a vector kernel.
+    struct Scalar {
+        static constexpr int width = 1;
+        using Mask = bool;
+        double v;
+
+        static Scalar load(const double* p) { return {*p}; }
+        static void store(double* p, Scalar a) { *p = a.v; }
+        static Scalar broadcast(double a) { return {a}; }
+
+        friend Scalar operator+(Scalar a, Scalar b) { return {a.v + b.v}; }
+        friend Scalar operator-(Scalar a, Scalar b) { return {a.v - b.v}; }
+        friend Scalar operator*(Scalar a, Scalar b) { return {a.v * b.v}; }
+        friend Scalar operator/(Scalar a, Scalar b) { return {a.v / b.v}; }
+
+        static Scalar sqrt(Scalar a) { return {std::sqrt(a.v)}; }
+        static Scalar min(Scalar a, Scalar b) { return {std::min(a.v, b.v)}; }
+        static Scalar max(Scalar a, Scalar b) { return {std::max(a.v, b.v)}; }
+        static Mask greater(Scalar a, Scalar b) { return a.v > b.v; }
+        static Scalar select(Mask m, Scalar a, Scalar b) { return m ? a : b; }
+        static unsigned int bits(Mask m) { return m ? 1u : 0u; }
+    };
+
+}
+
+#include "ForceKernelImpl.h"
+
+void pair_kernel_scalar(PairBatch& batch, double timestep) {
+    batch_contacts<Scalar>(batch, timestep);
+}
+
+PairKernel select_pair_kernel(const std::string& isa, std::string& name) {
+#ifdef MD_X86_KERNELS
+    // An ISA the CPU lacks falls back to the next one down
+    __builtin_cpu_init();
+    bool avx512 = __builtin_cpu_supports("avx512f");
+    bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    if ((isa == "auto" || isa == "avx512") && avx512) {
+        name = "avx512";
+        return pair_kernel_avx512;
+    }
+    if ((isa == "auto" || isa == "avx512" || isa == "avx2") && avx2) {
+        name = "avx2";
+        return pair_kernel_avx2;
+    }
+#endif
+    name = "scalar";
+    return pair_kernel_scalar;
+}
@@ -0,0 +1,67 @@
+#ifndef INC_3DMOLECULARDYNAMICS_FORCEKERNEL_H
+#define INC_3DMOLECULARDYNAMICS_FORCEKERNEL_H
+
+#include <string>
+
+/// Lanes of candidate ball-ball pairs for the batched contact kernel.
+///
+/// The caller gathers up to max_width pairs (i, j) lane by lane and pads the
+/// rest with zeros. The kernel masks out every lane that isn't in contact,
+/// sets its bit in contact and, for the lanes that are, overwrites the
+/// spring and fills in the force and torque on i (j takes minus both).
+struct PairBatch {
+    static constexpr int max_width = 8;
+
+    // Separation r_i - r_j, taken to the image of j the pair was found with
+    alignas(64) double dx[max_width];
+    alignas(64) double dy[max_width];
+    alignas(64) double dz[max_width];
+    // Relative velocity v_i - v_j
+    alignas(64) double dvx[max_width];
+    alignas(64) double dvy[max_width];
+    alignas(64) double dvz[max_width];
+    // Rolling term r_i*w_i + r_j*w_j
+    alignas(64) double wx[max_width];
+    alignas(64) double wy[max_width];
+    alignas(64) double wz[max_width];
+    alignas(64) double r1[max_width];
+    alignas(64) double r2[max_width];
+    // Material of i: 2Y/(3(1-poisson^2)), damping, tangential damping, friction
+    alignas(64) double kappa[max_width];
+    alignas(64) double damping[max_width];
+    alignas(64) double gamma[max_width];
+    alignas(64) double mu[max_width];
+    // Spring elongation, zero for a new contact
+    alignas(64) double sx[max_width];
+    alignas(64) double sy[max_width];
+    alignas(64) double sz[max_width];
+    // Force and torque on i
+    alignas(64) double fx[max_width];
+    alignas(64) double fy[max_width];
+    alignas(64) double fz[max_width];
+    alignas(64) double tx[max_width];
+    alignas(64) double ty[max_width];
+    alignas(64) double tz[max_width];
+    // Overlap (set for every lane) and normal approach speed
+    alignas(64) double xi[max_width];
+    alignas(64) double xidot[max_width];
+
+    /// Bit l is set if lane l is in contact
+    unsigned int contact{0};
+};
+
+using PairKernel = void (*)(PairBatch& batch, double timestep);
+
+/// Returns the batched ball-ball kernel for isa ("avx512", "avx2" or
+/// "scalar"), or with "auto" the widest one this CPU supports. name is set
+/// to the instruction set actually used.
+PairKernel select_pair_kernel(const std::string& isa, std::string& name);
+
+void pair_kernel_scalar(PairBatch& batch, double timestep);
+#ifdef MD_X86_KERNELS
+void pair_kernel_avx2(PairBatch& batch, double timestep);
+void pair_kernel_avx512(PairBatch& batch, double timestep);
+#endif
+
+
+#endif //INC_3DMOLECULARDYNAMICS_FORCEKERNEL_H
@@ -0,0 +1,98 @@
+#ifndef INC_3DMOLECULARDYNAMICS_FORCEKERNELIMPL_H
+#define INC_3DMOLECULARDYNAMICS_FORCEKERNELIMPL_H
+
+#include "ForceKernel.h"
+
+// Body of the batched ball-ball kernel, written once against a lane type V
+// and instantiated in each instruction set's own translation unit. V holds
+// V::width doubles and provides load, store, broadcast, the arithmetic
+// operators, sqrt, min, max, greater (giving a V::Mask), select and bits. Only include this from a file that defines such a type in an
+// anonymous namespace, so each instantiation stays local to its ISA.
+
+template<class V>
+inline void batch_contacts(PairBatch& b, double timestep) {
+    const V dt = V::broadcast(timestep);
+    const V zero = V::broadcast(0);
+    const V threshold = V::broadcast(1e-10);
+
+    unsigned int contact{0};
+    for (int l{0}; l < PairBatch::max_width; l += V::width) {
+        V dx = V::load(b.dx + l);
+        V dy = V::load(b.dy + l);
+        V dz = V::load(b.dz + l);
+        V r1 = V::load(b.r1 + l);
+        V r2 = V::load(b.r2 + l);
+
+        // Overlap, padding lanes have zero radii and never touch
+        V rr = V::sqrt(dx*dx + dy*dy + dz*dz);
+        V xi = r1 + r2 - rr;
+        V::store(b.xi + l, xi);
+        typename V::Mask touching = V::greater(xi, threshold);
+        unsigned int lanes = V::bits(touching);
+        contact |= lanes << l;
+        if (lanes == 0) continue;
+
+        V inv_rr = V::broadcast(1) / rr;
+        V nx = dx * inv_rr;
+        V ny = dy * inv_rr;
+        V nz = dz * inv_rr;
+
+        V dvx = V::load(b.dvx + l);
+        V dvy = V::load(b.dvy + l);
+        V dvz = V::load(b.dvz + l);
+        V wx = V::load(b.wx + l);
+        V wy = V::load(b.wy + l);
+        V wz = V::load(b.wz + l);
+
+        // Relative velocity at the contact point and its tangential part
+        V vx = dvx - (wy*nz - wz*ny);
+        V vy = dvy - (wz*nx - wx*nz);
+        V vz = dvz - (wx*ny - wy*nx);
+        V vn = vx*nx + vy*ny + vz*nz;
+        V vtx = vx - vn*nx;
+        V vty = vy - vn*ny;
+        V vtz = vz - vn*nz;
+        V vt2 = vtx*vtx + vty*vty + vtz*vtz;
+        V inv_vt = V::select(V::greater(vt2, zero), V::broadcast(1) / V::sqrt(vt2), zero);
+
+        // Update the springs
+        V sx = V::load(b.sx + l) + vtx*dt;
+        V sy = V::load(b.sy + l) + vty*dt;
+        V sz = V::load(b.sz + l) + vtz*dt;
+        V::store(b.sx + l, sx);
+        V::store(b.sy + l, sy);
+        V::store(b.sz + l, sz);
+
+        V xidot = zero - (nx*dvx + ny*dvy + nz*dvz);
+        V::store(b.xidot + l, xidot);
+
+        // Normal forces
+        V sqrt_xi = V::sqrt(V::max(xi, zero));
+        V force_constant = V::load(b.kappa + l) * V::sqrt(r1);
+        V elastic_force = force_constant * xi * sqrt_xi;
+        V dissipative_force = force_constant * V::load(b.damping + l) * sqrt_xi * xidot;
+        V fn = V::max(elastic_force + dissipative_force, zero);
+
+        // Tangential forces, capped by Coulomb friction
+        V cap = V::load(b.mu + l) * fn;
+        V elongation = V::sqrt(sx*sx + sy*sy + sz*sz);
+        V ft = zero - V::load(b.gamma + l) * elongation;
+        ft = V::min(V::max(ft, zero - cap), cap);
+        V ft_unit = ft * inv_vt;
+
+        // Total force and the torque it gives
+        V fx = V::select(touching, fn*nx + ft_unit*vtx, zero);
+        V fy = V::select(touching, fn*ny + ft_unit*vty, zero);
+        V fz = V::select(touching, fn*nz + ft_unit*vtz, zero);
+        V::store(b.fx + l, fx);
+        V::store(b.fy + l, fy);
+        V::store(b.fz + l, fz);
+        V::store(b.tx + l, fy*nz - fz*ny);
+        V::store(b.ty + l, fz*nx - fx*nz);
+        V::store(b.tz + l, fx*ny - fy*nx);
+    }
+    b.contact = contact;
+}
+
+
+#endif //INC_3DMOLECULARDYNAMICS_FORCEKERNELIMPL_H
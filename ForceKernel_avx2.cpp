@@ -0,0 +1,37 @@
+// Built with -mavx2 -mfma, only called once the CPU is known to support them
+
+#include "ForceKernel.h"
+#include <immintrin.h>
+
+namespace {
+
+    /// Four lanes in an AVX register.
+    struct Avx2 {
+        static constexpr int width = 4;
+        using Mask = __m256d;
+        __m256d v;
+
+        static Avx2 load(const double* p) { return {_mm256_load_pd(p)}; }
+        static void store(double* p, Avx2 a) { _mm256_store_pd(p, a.v); }
+        static Avx2 broadcast(double a) { return {_mm256_set1_pd(a)}; }
+
+        friend Avx2 operator+(Avx2 a, Avx2 b) { return {_mm256_add_pd(a.v, b.v)}; }
+        friend Avx2 operator-(Avx2 a, Avx2 b) { return {_mm256_sub_pd(a.v, b.v)}; }
+        friend Avx2 operator*(Avx2 a, Avx2 b) { return {_mm256_mul_pd(a.v, b.v)}; }
+        friend Avx2 operator/(Avx2 a, Avx2 b) { return {_mm256_div_pd(a.v, b.v)}; }
+
+        static Avx2 sqrt(Avx2 a) { return {_mm256_sqrt_pd(a.v)}; }
+        static Avx2 min(Avx2 a, Avx2 b) { return {_mm256_min_pd(a.v, b.v)}; }
+        static Avx2 max(Avx2 a, Avx2 b) { return {_mm256_max_pd(a.v, b.v)}; }
+        static Mask greater(Avx2 a, Avx2 b) { return _mm256_cmp_pd(a.v, b.v, _CMP_GT_OQ); }
+        static Avx2 select(Mask m, Avx2 a, Avx2 b) { return {_mm256_blendv_pd(b.v, a.v, m)}; }
+        static unsigned int bits(Mask m) { return unsigned(_mm256_movemask_pd(m)); }
+    };
+
+}
+
+#include "ForceKernelImpl.h"
+
+void pair_kernel_avx2(PairBatch& batch, double timestep) {
+    batch_contacts<Avx2>(batch, timestep);
+}
@@ -0,0 +1,37 @@
+// Built with -mavx512f, only called once the CPU is known to support it
+
+#include "ForceKernel.h"
+#include <immintrin.h>
+
+namespace {
+
+    /// Eight lanes in an AVX-512 register, the whole batch at once.
+    struct Avx512 {
+        static constexpr int width = 8;
+        using Mask = __mmask8;
+        __m512d v;
+
+        static Avx512 load(const double* p) { return {_mm512_load_pd(p)}; }
+        static void store(double* p, Avx512 a) { _mm512_store_pd(p, a.v); }
+        static Avx512 broadcast(double a) { return {_mm512_set1_pd(a)}; }
+
+        friend Avx512 operator+(Avx512 a, Avx512 b) { return {_mm512_add_pd(a.v, b.v)}; }
+        friend Avx512 operator-(Avx512 a, Avx512 b) { return {_mm512_sub_pd(a.v, b.v)}; }
+        friend Avx512 operator*(Avx512 a, Avx512 b) { return {_mm512_mul_pd(a.v, b.v)}; }
+        friend Avx512 operator/(Avx512 a, Avx512 b) { return {_mm512_div_pd(a.v, b.v)}; }
+
+        static Avx512 sqrt(Avx512 a) { return {_mm512_sqrt_pd(a.v)}; }
+        static Avx512 min(Avx512 a, Avx512 b) { return {_mm512_min_pd(a.v, b.v)}; }
+        static Avx512 max(Avx512 a, Avx512 b) { return {_mm512_max_pd(a.v, b.v)}; }
+        static Mask greater(Avx512 a, Avx512 b) { return _mm512_cmp_pd_mask(a.v, b.v, _CMP_GT_OQ); }
+        static Avx512 select(Mask m, Avx512 a, Avx512 b) { return {_mm512_mask_blend_pd(m, b.v, a.v)}; }
+        static unsigned int bits(Mask m) { return unsigned(m); }
+    };
+
+}
+
+#include "ForceKernelImpl.h"
+
+void pair_kernel_avx512(PairBatch& batch, double timestep) {
+    batch_contacts<Avx512>(batch, timestep);
+}
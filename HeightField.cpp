@@ -0,0 +1,157 @@
+#include "HeightField.h"
+#include <cmath>
+
+HeightField::HeightField(double spacing, double dimple_radius, double dimple_depth, double surface,
+                         double ball_radius, double resolution) {
+    tile_x = spacing;
+    tile_y = spacing*std::sqrt(3.0);
+    nx = std::max(int(std::ceil(tile_x / resolution)), 1);
+    ny = std::max(int(std::ceil(tile_y / resolution)), 1);
+    hx = tile_x / nx;
+    hy = tile_y / ny;
+    z_flat = surface + ball_radius;
+    this->ball_radius = ball_radius;
+
+    // Dimple centres that can be nearest to a point of the tile, the same
+    // lattice create_dimples() carves
+    const double centres[5][2] = {{0, 0}, {tile_x, 0}, {0, tile_y}, {tile_x, tile_y}, {tile_x/2, tile_y/2}};
+
+    double R = ball_radius;
+    double a = dimple_radius;
+    texels.resize(size_t(nx + 1)*(ny + 1));
+    for (int i{0}; i <= nx; i++) {
+        for (int j{0}; j <= ny; j++) {
+            double x = i*hx, y = j*hy;
+            double ex{0}, ey{0}, r{INFINITY};
+            for (const auto& c : centres) {
+                double d = std::hypot(x - c[0], y - c[1]);
+                if (d < r) {
+                    r = d;
+                    ex = x - c[0];
+                    ey = y - c[1];
+                }
+            }
+
+            // Outside a dimple the ball rests on the flat. Inside, it rests
+            // either on the rim, a distance a - r away, or on the bottom,
+            // whichever holds it higher.
+            Eigen::Vector3d n{0, 0, 1};
+            double dz{0};
+            if (r < a) {
+                double rho = std::min(a - r, R);
+                double on_rim = R - std::sqrt(R*R - rho*rho);
+                if (on_rim < dimple_depth) {
+                    dz = on_rim;
+                    // From the rim point back to the ball centre
+                    if (r > 0) n = Eigen::Vector3d{-rho*ex/r, -rho*ey/r, std::sqrt(R*R - rho*rho)}.normalized();
+                } else {
+                    dz = dimple_depth;
+                }
+            }
+            texels[size_t(i)*(ny + 1) + j] = {float(dz), float(n.x()), float(n.y()), float(n.z())};
+        }
+    }
+}
+
+void HeightField::sample(double x, double y, double& Z, Eigen::Vector3d& n) const {
+    // Into the tile, then bilinear interpolation between the four texels
+    double u = (x - tile_x*std::floor(x / tile_x)) / hx;
+    double v = (y - tile_y*std::floor(y / tile_y)) / hy;
+    int i = std::min(int(u), nx - 1);
+    int j = std::min(int(v), ny - 1);
+    double fu = u - i, fv = v - j;
+
+    const Texel& t00 = texels[size_t(i)*(ny + 1) + j];
+    const Texel& t01 = texels[size_t(i)*(ny + 1) + j + 1];
+    const Texel& t10 = texels[size_t(i + 1)*(ny + 1) + j];
+    const Texel& t11 = texels[size_t(i + 1)*(ny + 1) + j + 1];
+    double w00 = (1 - fu)*(1 - fv), w01 = (1 - fu)*fv, w10 = fu*(1 - fv), w11 = fu*fv;
+
+    Z = z_flat - (w00*t00.dz + w01*t01.dz + w10*t10.dz + w11*t11.dz);
+    n = Eigen::Vector3d{w00*t00.nx + w01*t01.nx + w10*t10.nx + w11*t11.nx,
+                        w00*t00.ny + w01*t01.ny + w10*t10.ny + w11*t11.ny,
+                        w00*t00.nz + w01*t01.nz + w10*t10.nz + w11*t11.nz}.normalized();
+}
+
+void HeightField::calibrate(double base_dx, double base_dy, double base_radius) {
+    // Deep enough for any overlap the balls reach, the table is cheap
+    const int samples = 8;
+    const int steps = 1024;
+    double R = ball_radius + base_radius;
+    law_max = ball_radius / 4;
+    law_step = law_max / steps;
+    double reach = std::sqrt(R*R - (R - law_max)*(R - law_max));
+    int ci = int(std::ceil(reach / base_dx)) + 1;
+    int cj = int(std::ceil(reach / base_dy)) + 1;
+
+    law_g.assign(steps + 1, 0);
+    law_d.assign(steps + 1, 0);
+    law_w.assign(steps + 1, 0);
+
+    // Sum the Hertz contacts with the spheres under a ball at each depth,
+    // averaged over where in a lattice cell (two rows tall) the ball sits.
+    // Each contact's vertical force goes as xi^(3/2)*n_z and its damping as
+    // sqrt(xi)*n_z^2, as its approach speed is n_z times the ball's.
+    for (int a{0}; a < samples; a++) {
+        for (int b{0}; b < samples; b++) {
+            double x0 = (a + 0.5) / samples * base_dx;
+            double y0 = (b + 0.5) / samples * 2*base_dy;
+            for (int i{-ci}; i <= ci; i++) {
+                for (int j{-cj}; j <= cj; j++) {
+                    double ex = x0 - (i*base_dx + (j & 1)*base_dx/2);
+                    double ey = y0 - j*base_dy;
+                    double rho2 = ex*ex + ey*ey;
+                    if (rho2 >= reach*reach) continue;
+                    for (int k{1}; k <= steps; k++) {
+                        double h = R - k*law_step;
+                        double dist = std::sqrt(rho2 + h*h);
+                        double xi = R - dist;
+                        if (xi <= 0) continue;
+                        double nz = h / dist;
+                        double sqrt_xi = std::sqrt(xi);
+                        law_g[k] += xi*sqrt_xi*nz;
+                        law_d[k] += sqrt_xi*nz*nz;
+                    }
+                }
+            }
+        }
+    }
+    for (int k{0}; k <= steps; k++) {
+        law_g[k] /= samples*samples;
+        law_d[k] /= samples*samples;
+        if (k > 0) law_w[k] = law_w[k - 1] + 0.5*(law_g[k - 1] + law_g[k])*law_step;
+    }
+}
+
+void HeightField::normal_law(double depth, double& g, double& d) const {
+    if (law_g.empty()) {
+        d = std::sqrt(depth);
+        g = depth*d;
+        return;
+    }
+    double u = depth / law_step;
+    if (u >= double(law_g.size() - 1)) {
+        // Past the table the law carries on as a single Hertz contact would
+        double s = depth / law_max;
+        d = law_d.back()*std::sqrt(s);
+        g = law_g.back()*s*std::sqrt(s);
+        return;
+    }
+    int k = int(u);
+    double f = u - k;
+    g = (1 - f)*law_g[k] + f*law_g[k + 1];
+    d = (1 - f)*law_d[k] + f*law_d[k + 1];
+}
+
+double HeightField::work(double depth) const {
+    if (law_g.empty()) return 0.4*depth*depth*std::sqrt(depth);
+    double u = depth / law_step;
+    if (u >= double(law_g.size() - 1)) {
+        double s = depth / law_max;
+        return law_w.back() + 0.4*law_g.back()*law_max*(s*s*std::sqrt(s) - 1);
+    }
+    int k = int(u);
+    double f = u - k;
+    double g = (1 - f)*law_g[k] + f*law_g[k + 1];
+    return law_w[k] + 0.5*(law_g[k] + g)*f*law_step;
+}
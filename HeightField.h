@@ -0,0 +1,78 @@
+#ifndef INC_3DMOLECULARDYNAMICS_HEIGHTFIELD_H
+#define INC_3DMOLECULARDYNAMICS_HEIGHTFIELD_H
+
+#include <Eigen/Dense>
+#include <cmath>
+#include <vector>
+#include "Memory.h"
+
+/// Tabulated contact surface of the dimpled plate for balls of one radius.
+///
+/// The plate is flat apart from round dimples on a hexagonal lattice, so
+/// its surface repeats over a spacing by sqrt(3)*spacing tile. On a fine
+/// grid over one tile the field stores how far below the flat rest height
+/// a ball's centre can sink, and the outward normal of the surface at the
+/// point it touches. Texels are floats to keep the table in cache.
+class HeightField {
+public:
+    /// surface is the height of the flat top of the plate, the dimples
+    /// have radius dimple_radius and depth dimple_depth.
+    HeightField(double spacing, double dimple_radius, double dimple_depth, double surface, double ball_radius,
+                double resolution);
+
+    /// Height above the plate of a resting ball's centre with the ball over
+    /// (x, y), and the surface normal there, interpolated from the table.
+    void sample(double x, double y, double& Z, Eigen::Vector3d& n) const;
+
+    /// Rest height of a ball centre over the flat part, the highest it gets
+    double top() const { return z_flat; }
+
+    /// Fits the normal law to a carpet of spheres of radius base_radius whose
+    /// tops make the flat, on a hexagonal lattice with base_dx between
+    /// columns and base_dy between rows. Without it a ball presses on the
+    /// surface as on a single sphere.
+    void calibrate(double base_dx, double base_dy, double base_radius);
+
+    /// Normal law of the surface at a depth below the rest height: the
+    /// elastic force is k*g and the damping force k*A*d*xidot, for the
+    /// Hertz constant k and damping factor A of a single contact.
+    void normal_law(double depth, double& g, double& d) const;
+
+    /// Integral of g up to depth, the elastic energy over k
+    double work(double depth) const;
+
+    /// Stiffness at depth relative to a single Hertz contact
+    double stiffening(double depth) const {
+        double g, d;
+        normal_law(depth, g, d);
+        return d / std::sqrt(depth);
+    }
+
+    size_t bytes() const { return texels.size()*sizeof(Texel) + 3*law_g.size()*sizeof(double); }
+
+    /// Key of the surface contact in a ball's contact history
+    static constexpr size_t contact_key = size_t(-1);
+
+private:
+    struct Texel {
+        float dz;           // Rest height below z_flat
+        float nx, ny, nz;   // Surface normal
+    };
+
+    double tile_x, tile_y;
+    int nx, ny;
+    double hx, hy;
+    double z_flat;
+    double ball_radius;
+
+    /// (nx+1) by (ny+1) texels, the last row and column repeat the first
+    PagedVector<Texel> texels;
+
+    /// Normal law tabulated at depths law_step apart up to law_max, with
+    /// its integral. Empty until calibrated.
+    std::vector<double> law_g, law_d, law_w;
+    double law_step{0}, law_max{0};
+};
+
+
+#endif //INC_3DMOLECULARDYNAMICS_HEIGHTFIELD_H
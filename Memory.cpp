@@ -0,0 +1,172 @@
+#include "Memory.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#ifdef __unix__
+#include <sys/mman.h>
+#endif
+
+namespace {
+
+    HugePages huge_pages{HugePages::none};
+    bool first_touch{false};
+
+    /// Whether map_pages maps blocks from the system rather than the heap
+    bool mapping() {
+        return huge_pages != HugePages::none || first_touch;
+    }
+
+    /// Blocks mapped in huge pages and their bytes, and the blocks that
+    /// asked for explicit pages and got transparent ones
+    std::atomic<size_t> huge_blocks{0}, huge_bytes{0}, explicit_fallbacks{0};
+
+    size_t round_up(size_t bytes, size_t to) {
+        return (bytes + to - 1) / to * to;
+    }
+
+    /// Length actually mapped for a block, the same in every mapping mode
+    size_t mapped_length(size_t bytes) {
+        return bytes < huge_page_bytes ? bytes : round_up(bytes, huge_page_bytes);
+    }
+
+    /// Whether the kernel gives transparent huge pages to madvise'd memory
+    bool transparent_available() {
+        static const bool available = []{
+            std::ifstream file("/sys/kernel/mm/transparent_hugepage/enabled");
+            std::string text;
+            std::getline(file, text);
+            return !text.empty() && text.find("[never]") == std::string::npos;
+        }();
+        return available;
+    }
+
+#ifdef __unix__
+    void* map_anonymous(size_t length, int flags) {
+        return mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+    }
+
+    /// Maps length bytes at a huge page boundary and asks for transparent
+    /// huge pages for them, nullptr if the kernel doesn't have them
+    void* map_transparent(size_t length) {
+#ifdef MADV_HUGEPAGE
+        if (!transparent_available()) return nullptr;
+        // Map a huge page more than needed and cut off the ends
+        void* raw = map_anonymous(length + huge_page_bytes, 0);
+        if (raw == MAP_FAILED) throw std::bad_alloc();
+        auto start = reinterpret_cast<uintptr_t>(raw);
+        uintptr_t aligned = round_up(start, huge_page_bytes);
+        if (aligned > start) munmap(raw, aligned - start);
+        munmap(reinterpret_cast<void*>(aligned + length), start + huge_page_bytes - aligned);
+        void* p = reinterpret_cast<void*>(aligned);
+        if (madvise(p, length, MADV_HUGEPAGE) == 0) {
+            huge_blocks++;
+            huge_bytes += length;
+        }
+        return p;
+#else
+        (void)length;
+        return nullptr;
+#endif
+    }
+
+    /// Maps length bytes from the hugetlbfs pool, nullptr if it can't
+    void* map_explicit(size_t length) {
+#ifdef MAP_HUGETLB
+        int flags = MAP_HUGETLB;
+#ifdef MAP_HUGE_2MB
+        flags |= MAP_HUGE_2MB;
+#endif
+        void* p = map_anonymous(length, flags);
+        if (p != MAP_FAILED) {
+            huge_blocks++;
+            huge_bytes += length;
+            return p;
+        }
+#endif
+        (void)length;
+        explicit_fallbacks++;
+        return nullptr;
+    }
+#endif
+
+}
+
+void set_huge_pages(HugePages mode) {
+    huge_pages = mode;
+}
+
+void set_first_touch(bool on) {
+    first_touch = on;
+}
+
+std::string describe_huge_pages() {
+    if (huge_pages == HugePages::none) return "off";
+    std::string text = huge_pages == HugePages::explicit_pages ? "explicit" : "transparent";
+    if (!transparent_available()) text += " (transparent huge pages are off in this kernel)";
+    auto blocks = [](size_t n){ return std::to_string(n) + (n == 1 ? " block" : " blocks"); };
+    text += ", " + blocks(huge_blocks) + ", " + std::to_string(huge_bytes / (1024*1024)) + " MB in huge pages";
+    if (explicit_fallbacks > 0) text += ", " + blocks(explicit_fallbacks) + " fell back from the hugetlbfs pool";
+    return text;
+}
+
+void* map_pages(size_t bytes) {
+#ifdef __unix__
+    if (mapping()) {
+        size_t length = mapped_length(bytes);
+        if (length >= huge_page_bytes) {
+            void* p{nullptr};
+            if (huge_pages == HugePages::explicit_pages) p = map_explicit(length);
+            if (!p && huge_pages != HugePages::none) p = map_transparent(length);
+            if (p) return p;
+        }
+        void* p = map_anonymous(length, 0);
+        if (p == MAP_FAILED) throw std::bad_alloc();
+        return p;
+    }
+#endif
+    void* p = std::malloc(bytes);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void unmap_pages(void* p, size_t bytes) {
+#ifdef __unix__
+    if (mapping()) {
+        munmap(p, mapped_length(bytes));
+        return;
+    }
+#endif
+    (void)bytes;
+    std::free(p);
+}
+
+ScratchArena::~ScratchArena() {
+    for (const Chunk& chunk : chunks) unmap_pages(chunk.base, chunk.bytes);
+}
+
+void* ScratchArena::take(size_t bytes, size_t align) {
+    size_t start = chunks.empty() ? 0 : round_up(used, align);
+    if (chunks.empty() || start + bytes > chunks.back().bytes) {
+        // Chunks at least double, so a step needs few of them
+        size_t size = std::max({huge_page_bytes, round_up(bytes, huge_page_bytes),
+                                chunks.empty() ? size_t{0} : 2*chunks.back().bytes});
+        chunks.push_back({static_cast<char*>(map_pages(size)), size});
+        start = 0;
+    }
+    used = start + bytes;
+    return chunks.back().base + start;
+}
+
+void ScratchArena::reset() {
+    used = 0;
+    if (chunks.size() < 2) return;
+    size_t size{0};
+    for (const Chunk& chunk : chunks) {
+        size += chunk.bytes;
+        unmap_pages(chunk.base, chunk.bytes);
+    }
+    chunks.assign(1, {static_cast<char*>(map_pages(size)), size});
+}
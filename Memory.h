@@ -0,0 +1,154 @@
+#ifndef INC_3DMOLECULARDYNAMICS_MEMORY_H
+#define INC_3DMOLECULARDYNAMICS_MEMORY_H
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/// Blocks from this size up go through map_pages. Smaller ones always come
+/// from the heap.
+constexpr size_t mapped_block_bytes{64*1024};
+
+/// Blocks from this size up are mapped in whole huge pages, aligned to them
+constexpr size_t huge_page_bytes{2*1024*1024};
+
+/// How the mapped blocks of huge_page_bytes and up are backed: by ordinary
+/// pages, by transparent huge pages (madvise) or by the hugetlbfs pool.
+/// Explicit pages fall back to transparent ones when the pool runs out,
+/// and transparent ones to ordinary pages when the kernel has them off.
+enum class HugePages { none, transparent, explicit_pages };
+
+/// Set how map_pages gets its blocks. Both are set once at start-up,
+/// before any large table is allocated, as a block has to be given back
+/// the way it was taken.
+void set_huge_pages(HugePages mode);
+
+/// With first touch on, blocks are mapped new from the system even without
+/// huge pages, so their pages are untouched until the thread that places
+/// them writes to them.
+void set_first_touch(bool on);
+
+/// e.g. "transparent, 6 blocks, 48 MB in huge pages", for the start of a run
+std::string describe_huge_pages();
+
+/// Blocks of memory mapped from the system when huge pages or first touch
+/// are on, and taken from the heap otherwise
+void* map_pages(size_t bytes);
+void unmap_pages(void* p, size_t bytes);
+
+/// Allocator for the large tables that last the whole run, such as the
+/// partners list and the cell list. Large blocks come from map_pages, so
+/// they get huge pages when those are on, and new elements are
+/// value-initialised as with std::allocator.
+template<class T>
+class PageAllocator : public std::allocator<T> {
+public:
+    template<class U>
+    struct rebind {
+        using other = PageAllocator<U>;
+    };
+
+    PageAllocator() = default;
+    template<class U>
+    PageAllocator(const PageAllocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        if (n*sizeof(T) < mapped_block_bytes) return std::allocator<T>::allocate(n);
+        return static_cast<T*>(map_pages(n*sizeof(T)));
+    }
+    void deallocate(T* p, size_t n) {
+        if (n*sizeof(T) < mapped_block_bytes) std::allocator<T>::deallocate(p, n);
+        else unmap_pages(p, n*sizeof(T));
+    }
+};
+
+/// Vector whose large blocks come from map_pages
+template<class T>
+using PagedVector = std::vector<T, PageAllocator<T>>;
+
+/// Allocator that leaves new elements default-initialised, so resizing a
+/// vector of numbers doesn't write to the memory it gets. The pages of
+/// large blocks then land on the NUMA node of the thread that first writes
+/// them rather than the one that resized the vector.
+template<class T>
+class FirstTouchAllocator : public PageAllocator<T> {
+public:
+    template<class U>
+    struct rebind {
+        using other = FirstTouchAllocator<U>;
+    };
+
+    FirstTouchAllocator() = default;
+    template<class U>
+    FirstTouchAllocator(const FirstTouchAllocator<U>&) noexcept {}
+
+    template<class U>
+    void construct(U* p) noexcept(std::is_nothrow_default_constructible_v<U>) {
+        ::new (static_cast<void*>(p)) U;
+    }
+    template<class U, class... Args>
+    void construct(U* p, Args&&... args) {
+        ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+    }
+};
+
+/// Vector whose pages are placed by first touch
+template<class T>
+using PlacedVector = std::vector<T, FirstTouchAllocator<T>>;
+
+/// Bump allocator for the temporaries of a step, such as the sorting
+/// buffers of a rebuild. Blocks are taken off the end of a chunk and only
+/// given back all at once by reset. Not for use by more than one thread.
+class ScratchArena {
+public:
+    ScratchArena() = default;
+    ScratchArena(const ScratchArena&) = delete;
+    ScratchArena& operator=(const ScratchArena&) = delete;
+    ~ScratchArena();
+
+    void* take(size_t bytes, size_t align);
+
+    /// Gives back everything taken. If that took more than one chunk they
+    /// are swapped for a single chunk as large as all of them, so after the
+    /// first few steps a step is served from one chunk.
+    void reset();
+
+private:
+    struct Chunk {
+        char* base;
+        size_t bytes;
+    };
+    std::vector<Chunk> chunks;
+    size_t used{0};
+};
+
+/// Allocator handing out blocks of a ScratchArena. Freeing does nothing,
+/// the vector must not outlive the next reset of the arena.
+template<class T>
+class ScratchAllocator {
+public:
+    using value_type = T;
+
+    explicit ScratchAllocator(ScratchArena& arena) noexcept : arena{&arena} {}
+    template<class U>
+    ScratchAllocator(const ScratchAllocator<U>& other) noexcept : arena{other.arena} {}
+
+    T* allocate(size_t n) { return static_cast<T*>(arena->take(n*sizeof(T), alignof(T))); }
+    void deallocate(T*, size_t) noexcept {}
+
+    template<class U>
+    bool operator==(const ScratchAllocator<U>& other) const noexcept { return arena == other.arena; }
+
+    ScratchArena* arena;
+};
+
+/// Vector on a ScratchArena, for the temporaries of a step
+template<class T>
+using ScratchVector = std::vector<T, ScratchAllocator<T>>;
+
+
+#endif //INC_3DMOLECULARDYNAMICS_MEMORY_H
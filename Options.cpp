@@ -127,6 +127,60 @@ Options read_input_file(const char* fname){
         else if (type == "#save_delay:"){
             stream >> programOptions.save_delay;
         }
+        else if (type == "#verlet_skin:"){
+            stream >> programOptions.verlet_skin;
+        }
+        else if (type == "#threads:"){
+            stream >> programOptions.threads;
+        }
+        else if (type == "#simd:"){
+            stream >> programOptions.simd;
+        }
+        else if (type == "#slow_force_hold:"){
+            stream >> programOptions.slow_force_hold;
+        }
+        else if (type == "#energy_check:"){
+            stream >> programOptions.energy_check;
+        }
+        else if (type == "#adaptive_timestep:"){
+            stream >> programOptions.adaptive_timestep;
+        }
+        else if (type == "#steps_per_collision:"){
+            stream >> programOptions.steps_per_collision;
+        }
+        else if (type == "#timestep_min:"){
+            stream >> programOptions.timestep_min;
+        }
+        else if (type == "#timestep_max:"){
+            stream >> programOptions.timestep_max;
+        }
+        else if (type == "#local_timestepping:"){
+            stream >> programOptions.local_timestepping;
+        }
+        else if (type == "#max_sleep:"){
+            stream >> programOptions.max_sleep;
+        }
+        else if (type == "#base_model:"){
+            stream >> programOptions.base_model;
+        }
+        else if (type == "#heightfield_resolution:"){
+            stream >> programOptions.heightfield_resolution;
+        }
+        else if (type == "#reorder_interval:"){
+            stream >> programOptions.reorder_interval;
+        }
+        else if (type == "#deterministic:"){
+            stream >> programOptions.deterministic;
+        }
+        else if (type == "#seed:"){
+            stream >> programOptions.seed;
+        }
+        else if (type == "#pin_threads:"){
+            stream >> programOptions.pin_threads;
+        }
+        else if (type == "#huge_pages:"){
+            stream >> programOptions.huge_pages;
+        }
         else {
             std::cout << "Unknown type: " << type << std::endl;
         }
@@ -24,6 +24,24 @@ struct ProgramOptions {
     double amplitude_end;
     double ramp_rate;
     bool dump_separate;
+    double verlet_skin{0}; // 0 rebuilds the neighbour list whenever a particle changes cell
+    int threads{1}; // 0 uses every hardware thread
+    std::string simd{"auto"}; // auto, avx512, avx2 or scalar
+    int slow_force_hold{1}; // steps each ball-ball force evaluation is held for, the plate forces run every step; the energy drifts above 1
+    bool energy_check{false}; // print the total energy and its drift with the stats
+    bool adaptive_timestep{false}; // vary the timestep with the shortest collision under way
+    double steps_per_collision{50};
+    double timestep_min{0}; // 0 uses a tenth of timestep
+    double timestep_max{0}; // 0 uses the collision of two balls at 1 mm/s
+    bool local_timestepping{false}; // fly contact-free balls ballistically
+    int max_sleep{1000}; // longest ballistic flight in nominal timesteps
+    std::string base_model{"particles"}; // particles, heightfield or validate
+    double heightfield_resolution{2e-5};
+    int reorder_interval{0}; // steps between Morton reorders of the balls, 0 for never
+    bool deterministic{false}; // add the forces up in an order independent of the threads
+    unsigned int seed{0}; // seed of the ball placement, 0 draws one
+    bool pin_threads{false}; // pin the threads over the NUMA nodes and place the balls' arrays by first touch
+    std::string huge_pages{"none"}; // none, transparent or explicit, for the large tables
 };
 
 struct SystemProps {
@@ -3,159 +3,154 @@
 //
 
 #include "Particle.h"
+#include <algorithm>
 #include <cmath>
+#include <cstdlib>
 
+int ParticleStore::add_type(const ParticleProps &props) {
+    types.push_back(props);
+    hertz_constant.push_back(2*props.youngs_modulus/(3*(1-props.poisson*props.poisson)));
+    return int(types.size()) - 1;
+}
 
+size_t ParticleStore::add(double x, double y, double z, int t) {
+    const ParticleProps& props = types[t];
+    rtd0.emplace_back(x, y, z);
+    for (auto* v : {&rtd1, &rtd2, &rtd3, &rot0, &rot1, &rot2, &rot3, &force, &torque}) {
+        v->push_back(null_vec);
+    }
+    radius.push_back(props.radius);
+    mass.push_back(props.mass);
+    inertia.push_back(0.4*props.mass*props.radius*props.radius);
+    inverse_mass.push_back(1/mass.back());
+    inverse_inertia.push_back(1/inertia.back());
+    type.push_back(t);
+    return size() - 1;
+}
 
-bool force(Particle &p1, Particle &p2, double lx, double ly, double lz, double timestep) {
-    double dx = normalize(p1.x() - p2.x(), lx);
-    double dy = normalize(p1.y() - p2.y(), ly);
-    double dz = normalize(p1.z() - p2.z(), lz);
-    if (std::abs(dx) < p1.r() + p2.r() && std::abs(dy) < p1.r() + p2.r() && std::abs(dz) < p1.r() + p2.r()){
-        Eigen::Vector3d dr = {dx, dy, dz};
-        double rr = dr.norm();
-        double r1 = p1.r();
-        double r2 = p2.r();
-
-        // Overlap
-        double xi = r1 + r2 - rr;
-
-        if (xi > 1e-10) { // If overlapping
-
-
-
-            double Y = p1._youngs_modulus;
-            double poisson = p1._poisson;
-            double force_constant = 2*Y*sqrt(r1)/(3*(1-poisson*poisson));
-
-            double sqrt_xi = sqrt(xi);
-
-
-            Eigen::Vector3d dv = p1.rtd1 - p2.rtd1;
+void ParticleStore::permute(const std::vector<int>& order) {
+    for (auto* v : {&rtd0, &rtd1, &rtd2, &rtd3, &rot0, &rot1, &rot2, &rot3, &force, &torque}) {
+        ::permute(*v, order);
+    }
+    for (auto* v : {&radius, &mass, &inertia, &inverse_mass, &inverse_inertia}) {
+        ::permute(*v, order);
+    }
+    ::permute(type, order);
+}
 
+void ParticleStore::place(ThreadPool& pool, const std::vector<size_t>& shares) {
+    size_t n = size();
+    auto place_array = [&](auto& v){
+        std::remove_reference_t<decltype(v)> fresh;
+        fresh.resize(n);
+        pool.run([&](int t){
+            size_t begin = std::min(shares[t], n);
+            size_t end = t + 1 == pool.size() ? n : std::min(shares[t + 1], n);
+            std::copy(v.begin() + begin, v.begin() + end, fresh.begin() + begin);
+        });
+        v.swap(fresh);
+    };
+    for (auto* v : {&rtd0, &rtd1, &rtd2, &rtd3, &rot0, &rot1, &rot2, &rot3, &force, &torque}) {
+        place_array(*v);
+    }
+    for (auto* v : {&radius, &mass, &inertia, &inverse_mass, &inverse_inertia}) {
+        place_array(*v);
+    }
+    place_array(type);
+}
 
-//            Eigen::Vector3d n = dr.normalized();
-            Eigen::Vector3d n = dr / rr;
+bool ParticleStore::periodic_bc(double x_0, double y_0, double lx, double ly, size_t begin, size_t end,
+                                unsigned char* wraps) {
+    bool wrapped{false};
+    for (size_t i{begin}; i < end; i++) {
+        Eigen::Vector3d& r = rtd0[i];
+        if (r.x() >= x_0 && r.x() <= x_0 + lx && r.y() >= y_0 && r.y() <= y_0 + ly) continue;
+        wrapped = true;
+        int sx{0}, sy{0};
+        while (r.x() < x_0) { r.x() += lx; sx++; }
+        while (r.x() > x_0 + lx) { r.x() -= lx; sx--; }
+        while (r.y() < y_0) { r.y() += ly; sy++; }
+        while (r.y() > y_0 + ly) { r.y() -= ly; sy--; }
+        wraps[i] = std::abs(sx) > 1 || std::abs(sy) > 1 ? 255 : (unsigned char)((sx + 1)*3 + sy + 1);
+    }
+    return wrapped;
+}
 
-            Eigen::Vector3d vrel = dv - (r1*p1.rot1 + r2*p2.rot1).cross(n);
-            Eigen::Vector3d vtrel = vrel - vrel.dot(n)*n;
-            Eigen::Vector3d t = vtrel.normalized();
+double base_force_constant(const ParticleProps& mp, const ParticleProps& mb, double r1) {
+    double Y = (mp.youngs_modulus*mb.youngs_modulus)/(mp.youngs_modulus+mb.youngs_modulus);
+    double poisson = 0.5*(mp.poisson+mb.poisson);
+    return 2*Y*sqrt(r1)/(3*(1-poisson*poisson));
+}
 
-            // Update the contacts
-            if (p1.particle_contacts.find(p2.index) == p1.particle_contacts.end()){
-                // No contact
-                p1.particle_contacts[p2.index] = vtrel*timestep;
-            }
-            else {
-                p1.particle_contacts[p2.index] += vtrel*timestep;
-            }
+namespace {
 
+    /// Force and torque on ball i of ps pressed into the plate (material
+    /// mb) along the outward normal n, with a normal force of elastic_force
+    /// plus damping times the approach speed. The spring is kept in
+    /// contacts under key.
+    void plate_contact(const ParticleStore &ps, size_t i, const ParticleProps& mb, const Eigen::Vector3d& n,
+                       double elastic_force, double damping,
+                       const BasePlate &basePlate, double timestep, ContactHistory& contacts, size_t key,
+                       unsigned int epoch, Eigen::Vector3d& f, Eigen::Vector3d& t, double& xidot) {
+        double r1 = ps.radius[i];
+        const ParticleProps& mp = ps.props(i);
 
-            double xidot = -(n.dot(dv));
+        Eigen::Vector3d dv = ps.rtd1[i] - Eigen::Vector3d(0, 0, basePlate.vz());
 
-            double gamma = p1._tangential_damping;
+        Eigen::Vector3d vrel = dv -  (r1*ps.rot1[i]).cross(n);
+        Eigen::Vector3d vtrel = vrel - vrel.dot(n)*n;
 
-            // Normal Forces
-            double elastic_force = force_constant * xi * sqrt_xi;
-            double dissipative_force = force_constant * p1._damping_constant * sqrt_xi * xidot;
-            double fn = elastic_force + dissipative_force;
-            if (fn < 0) fn = 0;
+        // Update the contacts
+        Eigen::Vector3d& spring = contacts.touch(key, epoch);
+        spring += vtrel*timestep;
 
-            // Tangential forces
-            double mu = p1._friction;
-            double elongation = p1.particle_contacts[p2.index].norm();
-            double ft = -gamma * elongation;
-            if (ft < -mu*fn) ft = -mu*fn;
-            if (ft>mu*fn) ft = mu*fn;
+        Eigen::Vector3d tangent = vtrel.normalized();
 
-            // Total force
-            Eigen::Vector3d force = fn*n + ft*t;
+        xidot = -n.dot(dv);
+        double gamma = 0.5*(mp.tangential_damping+mb.tangential_damping);
 
-            Eigen::Vector3d torque = force.cross(n);
+        // Normal forces
+        double dissipative_force = damping * xidot;
+        double fn = elastic_force + dissipative_force;
+        if (fn < 0) fn = 0;
 
-            p1.add_force(force);
-            p2.add_force(-1*force);
+        // Tangential forces
+        double mu = mp.friction;
+        double elongation = spring.norm();
+        double ft = -gamma * elongation;
+        if (ft < -mu*fn) ft = -mu*fn;
+        if (ft > mu*fn) ft = mu*fn;
 
-            p1.add_torque(torque);
-            p2.add_torque(-1*torque);
-            return true;
-        }
-        else{
-            return false;
-        }
+        // Total force
+        f = fn*n + ft*tangent;
+        t = f.cross(n);
     }
-    return false;
-}
 
-
-void Particle::periodic_bc(double x_0, double y_0, double lx, double ly) {
-    while (rtd0.x() < x_0) rtd0.x() += lx;
-    while (rtd0.x() > x_0 + lx) rtd0.x() -= lx;
-    while (rtd0.y() < y_0) rtd0.y() += ly;
-    while (rtd0.y() > y_0 + ly) rtd0.y() -= ly;
 }
 
-bool force(Particle &p, Particle &b, BasePlate &basePlate, double timestep) {
-    double dx = p.x() - b.x();
-    double dy = p.y() - b.y();
-    double dz = p.z() - (basePlate.z()+b.z());
-    if (std::abs(dx) < p.r() + b.r() && std::abs(dy) < p.r() + b.r() && std::abs(dz) < p.r() + b.r()) {
+bool force(const ParticleStore &ps, size_t i, const Eigen::Vector3d& site, const ParticleProps& mb, size_t k,
+           const BasePlate &basePlate, double timestep,
+           ContactHistory& contacts, unsigned int epoch, Eigen::Vector3d& f, Eigen::Vector3d& t,
+           double& xi, double& xidot) {
+    double dx = ps.x(i) - site.x();
+    double dy = ps.y(i) - site.y();
+    double dz = ps.z(i) - (basePlate.z()+site.z());
+    double r1 = ps.radius[i];
+    double r2 = mb.radius;
+    if (std::abs(dx) < r1 + r2 && std::abs(dy) < r1 + r2 && std::abs(dz) < r1 + r2) {
         Eigen::Vector3d dr = {dx, dy, dz};
         double rr = dr.norm();
-        double r1 = p.r();
-        double r2 = b.r();
 
         // Overlap
-        double xi = r1 + r2 - rr;
+        xi = r1 + r2 - rr;
         if (xi > 1e-10) {
-
-
-
-            double Y = (p._youngs_modulus*b._youngs_modulus)/(p._youngs_modulus+b._youngs_modulus);
-            double poisson = 0.5*(p._poisson+b._poisson);
-            double A = 0.5*(p._damping_constant + b._damping_constant);
-            double force_constant = 2*Y*sqrt(r1)/(3*(1-poisson*poisson));
-            double sqrt_xi = sqrt(xi);
-
-            Eigen::Vector3d dv = p.rtd1 - Eigen::Vector3d(0, 0, basePlate.vz());
-
 //            Eigen::Vector3d n = dr.normalized();
-            Eigen::Vector3d n = dr / rr;
-            Eigen::Vector3d vrel = dv -  (r1*p.rot1).cross(n);
-            Eigen::Vector3d vtrel = vrel - vrel.dot(n)*n;
-
-            // Update the contacts
-            if (p.base_contacts.find(b.index) == p.base_contacts.end()){
-                // No contact
-                p.base_contacts[b.index] = vtrel*timestep;
-            }
-            else {
-                p.base_contacts[b.index] += vtrel*timestep;
-            }
-
-            Eigen::Vector3d t = vtrel.normalized();
-
-            double xidot = -n.dot(dv);
-            double gamma = 0.5*(p._tangential_damping+b._tangential_damping);
-
-            // Normal forces
-            double elastic_force = force_constant * xi * sqrt_xi;
-            double dissipative_force = force_constant * A * sqrt_xi * xidot;
-            double fn = elastic_force + dissipative_force;
-            if (fn < 0) fn = 0;
-
-            // Tangential forces
-            double mu = p._friction;
-            double elongation = p.base_contacts[b.index].norm();
-            double ft = -gamma * elongation;
-            if (ft < -mu*fn) ft = -mu*fn;
-            if (ft > mu*fn) ft = mu*fn;
-
-            // Total force
-            Eigen::Vector3d force = fn*n + ft*t;
-            Eigen::Vector3d torque = force.cross(n);
-            p.add_force(force);
-            p.add_torque(torque);
+            const ParticleProps& mp = ps.props(i);
+            double A = 0.5*(mp.damping_factor + mb.damping_factor);
+            double force_constant = base_force_constant(mp, mb, r1);
+            double sqrt_xi = sqrt(xi);
+            plate_contact(ps, i, mb, dr / rr, force_constant * xi * sqrt_xi, force_constant * A * sqrt_xi,
+                          basePlate, timestep, contacts, k, epoch, f, t, xidot);
             return true;
         }
         else{
@@ -165,64 +160,96 @@ bool force(Particle &p, Particle &b, BasePlate &basePlate, double timestep) {
     return false;
 }
 
-void Particle::predict(double dt) {
-    double a1 = dt;
-    double a2 = a1*dt/2;
-    double a3 = a2*dt/3;
-
-    rtd0 += a1*rtd1 + a2*rtd2 + a3*rtd3;
-    rtd1 += a1*rtd2 + a2*rtd3;
-    rtd2 += a1*rtd3;
-
-    rot0 += a1*rot1 + a2*rot2 + a3*rot3;
-    rot1 += a1*rot2 + a2*rot3;
-    rot2 += a1*rot3;
+bool force(const ParticleStore &ps, size_t i, const HeightField& field, const ParticleProps& mb,
+           const BasePlate &basePlate, double timestep,
+           ContactHistory& contacts, unsigned int epoch, Eigen::Vector3d& f, Eigen::Vector3d& t,
+           double& xi, double& xidot) {
+    double Z;
+    Eigen::Vector3d n;
+    field.sample(ps.x(i), ps.y(i), Z, n);
+
+    // Overlap along the normal, to first order in the sink below the rest height
+    xi = (basePlate.z() + Z - ps.z(i)) * n.z();
+    if (xi > 1e-10) {
+        const ParticleProps& mp = ps.props(i);
+        double A = 0.5*(mp.damping_factor + mb.damping_factor);
+        double force_constant = base_force_constant(mp, mb, ps.radius[i]);
+        double g, d;
+        field.normal_law(xi, g, d);
+        plate_contact(ps, i, mb, n, force_constant * g, force_constant * A * d,
+                      basePlate, timestep, contacts, HeightField::contact_key, epoch, f, t, xidot);
+        return true;
+    }
+    return false;
 }
 
-void Particle::correct(double dt, Eigen::Vector3d G) {
-
-    static Eigen::Vector3d accel, corr, rot_accel, rot_corr;
+GearCoefficients::GearCoefficients(double dt) {
+    a1 = dt;
+    a2 = a1*dt/2;
+    a3 = a2*dt/3;
 
     double dtrez = 1/dt;
-    const double coeff0 = double(1)/double(6) * (dt*dt/double(2));
-    const double coeff1 = double(5)/double(6)*(dt/double(2));
-    const double coeff3 = double(1)/double(3)*(double(3)*dtrez);
-
-    accel = Eigen::Vector3d((1/_m)*_force.x()+G.x(), (1/_m)*_force.y()+G.y(), (1/_m)*_force.z()+G.z());
-    corr = accel - rtd2;
-    rtd0 += coeff0*corr;
-    rtd1 += coeff1*corr;
-    rtd2 = accel;
-    rtd3 += coeff3*corr;
-
-    rot_accel = _torque * (1/J);
-    rot_corr = rot_accel - rot2;
-    rot0 += coeff0*rot_corr;
-    rot1 += coeff1*rot_corr;
-    rot2 = rot_accel;
-    rot3 += coeff3*rot_corr;
+    c0 = double(1)/double(6) * (dt*dt/double(2));
+    c1 = double(5)/double(6)*(dt/double(2));
+    c3 = double(1)/double(3)*(double(3)*dtrez);
 }
 
-void Particle::update_base_contacts(std::set<size_t>& contacts){
-    std::set<size_t> to_delete;
-    for (const auto& [key, value] : base_contacts){
-        if (!contacts.contains(key)){
-            to_delete.insert(key);
-        }
-    }
-    for (size_t k: to_delete){
-        base_contacts.erase(k);
+void ParticleStore::set_forces_to_zero(size_t begin, size_t end) {
+    std::fill(force.begin() + begin, force.begin() + end, null_vec);
+    std::fill(torque.begin() + begin, torque.begin() + end, null_vec);
+}
+
+void ParticleStore::predict(const GearCoefficients& gear, size_t begin, size_t end) {
+    const double a1 = gear.a1, a2 = gear.a2, a3 = gear.a3;
+    double* r0 = rtd0.data()->data();
+    double* r1 = rtd1.data()->data();
+    double* r2 = rtd2.data()->data();
+    const double* r3 = rtd3.data()->data();
+    double* w0 = rot0.data()->data();
+    double* w1 = rot1.data()->data();
+    double* w2 = rot2.data()->data();
+    const double* w3 = rot3.data()->data();
+
+    for (size_t k{3*begin}; k < 3*end; k++) {
+        r0[k] += a1*r1[k] + a2*r2[k] + a3*r3[k];
+        r1[k] += a1*r2[k] + a2*r3[k];
+        r2[k] += a1*r3[k];
+
+        w0[k] += a1*w1[k] + a2*w2[k] + a3*w3[k];
+        w1[k] += a1*w2[k] + a2*w3[k];
+        w2[k] += a1*w3[k];
     }
 }
 
-void Particle::update_particle_contacts(std::set<size_t>& contacts){
-    std::set<size_t> to_delete;
-    for (const auto& [key, value] : particle_contacts){
-        if (!contacts.contains(key)){
-            to_delete.insert(key);
+void ParticleStore::correct(const GearCoefficients& gear, const Eigen::Vector3d& G, size_t begin, size_t end) {
+    const double c0 = gear.c0, c1 = gear.c1, c3 = gear.c3;
+    double* r0 = rtd0.data()->data();
+    double* r1 = rtd1.data()->data();
+    double* r2 = rtd2.data()->data();
+    double* r3 = rtd3.data()->data();
+    double* w0 = rot0.data()->data();
+    double* w1 = rot1.data()->data();
+    double* w2 = rot2.data()->data();
+    double* w3 = rot3.data()->data();
+    const double* F = force.data()->data();
+    const double* T = torque.data()->data();
+
+    for (size_t i{begin}; i < end; i++) {
+        for (size_t c{0}; c < 3; c++) {
+            size_t k = 3*i + c;
+            double accel = inverse_mass[i]*F[k] + G[c];
+            double corr = accel - r2[k];
+            r0[k] += c0*corr;
+            r1[k] += c1*corr;
+            r2[k] = accel;
+            r3[k] += c3*corr;
+
+            double rot_accel = T[k]*inverse_inertia[i];
+            double rot_corr = rot_accel - w2[k];
+            w0[k] += c0*rot_corr;
+            w1[k] += c1*rot_corr;
+            w2[k] = rot_accel;
+            w3[k] += c3*rot_corr;
         }
     }
-    for (size_t k: to_delete){
-        particle_contacts.erase(k);
-    }
 }
@@ -6,99 +6,155 @@
 #define INC_3DMOLECULARDYNAMICS_PARTICLE_H
 
 #include <iostream>
+#include <cmath>
 #include "BasePlate.h"
 #include "Options.h"
+#include "ContactHistory.h"
+#include "HeightField.h"
+#include "Memory.h"
+#include "ThreadPool.h"
 #include <Eigen/Dense>
-#include <map>
-#include <set>
+#include <vector>
 
 const Eigen::Vector3d null_vec{0, 0, 0};
 
+// The integrator treats arrays of vectors as flat arrays of doubles
+static_assert(sizeof(Eigen::Vector3d) == 3*sizeof(double));
+
 inline double normalize(double dx, double L) {
     while (dx < -L / 2) dx += L;
     while (dx >= L / 2) dx -= L;
     return dx;
 }
 
-class Particle {
-    //////////////////////
-    /// Force calculation
-    //////////////////////
-    friend bool force(Particle& p1, Particle& p2, double lx, double ly, double lz, double timestep);
-    friend bool force(Particle& p, Particle& b, BasePlate& basePlate, double timestep);
+/// Rearranges v so that element n is the old element order[n].
+template<class T, class A>
+void permute(std::vector<T, A>& v, const std::vector<int>& order) {
+    std::vector<T, A> out;
+    out.reserve(v.size());
+    for (int k : order) out.push_back(std::move(v[k]));
+    v.swap(out);
+}
 
+/// Coefficients of the Gear predictor-corrector for one timestep, worked
+/// out once per step and shared by every particle.
+struct GearCoefficients {
+    explicit GearCoefficients(double dt);
 
+    // Taylor series coefficients of the predictor
+    double a1, a2, a3;
+    // Corrector coefficients for position, velocity and third derivative
+    double c0, c1, c3;
+};
+
+/// Structure-of-arrays storage for a set of particles.
+///
+/// Each state vector lives in its own contiguous array indexed by particle,
+/// so the integrator and force loops only stream through the fields they use.
+/// Material parameters are stored once per particle type.
+class ParticleStore {
 public:
-    Particle(double x, double y, double z, size_t index, ParticleProps props) :
-        rtd0(x, y, z), index(index), rtd1(null_vec), rtd2(null_vec), _r(props.radius),
-        _m(props.mass), _youngs_modulus(props.youngs_modulus), _poisson(props.poisson),
-        _damping_constant(props.damping_factor), _friction(props.friction), _tangential_damping(props.tangential_damping){J = 0.4*_m*_r*_r;}
-    Particle(const Particle& rhs) = default;
-    Particle(Particle && rhs) = default;
-    Particle& operator=(const Particle & rhs) = default;
-    Particle& operator=(Particle && rhs) = default;
-    virtual ~Particle() = default;
+    /// Registers a particle type and returns its index.
+    int add_type(const ParticleProps& props);
 
-    ///////////////////////////////////////
-    /// Getters
-    ///////////////////////////////////////
-    double& r() { return _r; }
-    double r() const { return _r; }
-    double m() const { return _m; }
-
-    double& x() { return rtd0.x(); }
-    double x() const { return rtd0.x(); }
-    double& y() { return rtd0.y(); }
-    double y() const { return rtd0.y(); }
-    double& z() { return rtd0.z(); }
-    double z() const { return rtd0.z(); }
-    double& vx() { return rtd1.x(); }
-    double vx() const { return rtd1.x(); }
-    double& vy() { return rtd1.y(); }
-    double vy() const { return rtd1.y(); }
-    double& vz() { return rtd1.z(); }
-    double vz() const { return rtd1.z(); }
-    Eigen::Vector3d & force() {return _force;}
-    Eigen::Vector3d force() const {return _force;}
+    /// Adds a particle at rest with the radius and mass of its type.
+    size_t add(double x, double y, double z, int type);
+
+    size_t size() const { return rtd0.size(); }
+
+    /// Reorders the particles so that particle n is the old particle order[n].
+    void permute(const std::vector<int>& order);
+
+    /// Moves every array to new memory, thread t of pool writing particles
+    /// shares[t] up to shares[t+1] first, so that with pinned threads the
+    /// pages of its share sit on its own NUMA node.
+    void place(ThreadPool& pool, const std::vector<size_t>& shares);
 
     ///////////////////////////////////////
-    /// Setters
+    /// Getters
     ///////////////////////////////////////
-    void add_force(const Eigen::Vector3d& f) {_force += f;}
-    void add_torque(const Eigen::Vector3d & t) {_torque += t;}
-    void periodic_bc(double x_0, double y_0, double lx, double ly);
-    void set_force_to_zero() { _force = null_vec;}
-    void set_torque_to_zero() {_torque = null_vec;}
-    void set_z(double z) {rtd0 += Eigen::Vector3d(0, 0, z);}
+    double r(size_t i) const { return radius[i]; }
+    double m(size_t i) const { return mass[i]; }
+    double x(size_t i) const { return rtd0[i].x(); }
+    double y(size_t i) const { return rtd0[i].y(); }
+    double z(size_t i) const { return rtd0[i].z(); }
+    double vx(size_t i) const { return rtd1[i].x(); }
+    double vy(size_t i) const { return rtd1[i].y(); }
+    double vz(size_t i) const { return rtd1[i].z(); }
+    const ParticleProps& props(size_t i) const { return types[type[i]]; }
 
     ///////////////////////////////////////
     /// Integration
     ////////////////////////////////////
-    void predict(double dt);
-    void correct(double dt, Eigen::Vector3d G);
-
-    void update_base_contacts(std::set<size_t>& contacts);
-    void update_particle_contacts(std::set<size_t>& contacts);
-
-private:
-    Eigen::Vector3d rtd0{null_vec}, rtd1{null_vec}, rtd2{null_vec}, rtd3{null_vec};
-    Eigen::Vector3d rot0{null_vec}, rot1{null_vec}, rot2{null_vec}, rot3{null_vec};
-    Eigen::Vector3d _force{null_vec};
-    Eigen::Vector3d _torque{null_vec};
-    double _r;
-    double _m;
-    double _youngs_modulus;
-    double _poisson;
-    double _damping_constant;
-    double J{0};
-    double _friction; // Coefficient of friction
-    double _tangential_damping;
-    size_t index;
-
-    // Keep track of contacts with base particles
-    std::map<size_t, Eigen::Vector3d> base_contacts; // <particle index, spring elongation>
-
-    std::map<size_t, Eigen::Vector3d> particle_contacts;
-
+    // Each works on particles [begin, end) so that blocks can be handed to
+    // different threads. The loops run over the arrays as flat doubles.
+    void set_forces_to_zero(size_t begin, size_t end);
+    void predict(const GearCoefficients& gear, size_t begin, size_t end);
+    void correct(const GearCoefficients& gear, const Eigen::Vector3d& G, size_t begin, size_t end);
+    /// Returns whether any particle was moved round the box. A particle
+    /// moved by sx boxes along x and sy along y gets wraps[i] set to
+    /// (sx+1)*3 + sy+1, or 255 if it went round more than once; the others
+    /// are left as they are.
+    bool periodic_bc(double x_0, double y_0, double lx, double ly, size_t begin, size_t end, unsigned char* wraps);
+
+    // Position and rotation with their first three time derivatives
+    PlacedVector<Eigen::Vector3d> rtd0, rtd1, rtd2, rtd3;
+    PlacedVector<Eigen::Vector3d> rot0, rot1, rot2, rot3;
+    PlacedVector<Eigen::Vector3d> force, torque;
+
+    PlacedVector<double> radius;
+    PlacedVector<double> mass;
+    PlacedVector<double> inertia;
+    PlacedVector<double> inverse_mass;
+    PlacedVector<double> inverse_inertia;
+    PlacedVector<int> type;
+
+    /// Material parameters of each particle type
+    std::vector<ParticleProps> types;
+
+    /// 2Y/(3(1-poisson^2)) of each type, the Hertz force constant without
+    /// the sqrt(radius)
+    std::vector<double> hertz_constant;
 };
+
+//////////////////////
+/// Force calculation
+//////////////////////
+
+// Ball-ball contacts are worked out in batches, see ForceKernel.h
+
+/// Hertz force constant between a ball of radius r1 and a base particle.
+double base_force_constant(const ParticleProps& mp, const ParticleProps& mb, double r1);
+
+/// Contact force between particle i of ps and base site k, made of the
+/// material mb and sitting at site relative to the plate. The spring is
+/// kept in the contact history of i under key k. On contact returns true
+/// and sets f and t to the force and torque on i, and xi and xidot to the
+/// overlap and normal approach speed.
+bool force(const ParticleStore& ps, size_t i, const Eigen::Vector3d& site, const ParticleProps& mb, size_t k,
+           const BasePlate& basePlate, double timestep,
+           ContactHistory& contacts, unsigned int epoch, Eigen::Vector3d& f, Eigen::Vector3d& t,
+           double& xi, double& xidot);
+
+/// Contact force between particle i of ps and the plate surface in field,
+/// made of the material mb. Works as the base site force() with the
+/// surface as a single contact following the field's normal law, and xi
+/// its depth.
+bool force(const ParticleStore& ps, size_t i, const HeightField& field, const ParticleProps& mb,
+           const BasePlate& basePlate, double timestep,
+           ContactHistory& contacts, unsigned int epoch, Eigen::Vector3d& f, Eigen::Vector3d& t,
+           double& xi, double& xidot);
+
+/// Duration of a Hertz collision (normal force k*xi^(3/2)) between bodies
+/// of reduced mass m that meet at speed v.
+inline double hertz_collision_time(double m, double k, double v) {
+    return 2.9432 * std::pow(5*m / (4*k), 0.4) * std::pow(v, -0.2);
+}
+
+/// Speed at which a contact with overlap xi, closing at xidot, first
+/// touched, ignoring damping.
+inline double impact_speed(double m, double k, double xi, double xidot) {
+    return std::sqrt(xidot*xidot + 0.8*k*xi*xi*std::sqrt(xi)/m);
+}
+
 #endif //INC_3DMOLECULARDYNAMICS_PARTICLE_H
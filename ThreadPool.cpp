@@ -0,0 +1,108 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(int n) : queues(n > 0 ? n : std::max(int(std::thread::hardware_concurrency()), 1)) {
+    n_threads = int(queues.size());
+    for (int t{1}; t < n_threads; t++) {
+        workers.emplace_back(&ThreadPool::work, this, t);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    start.notify_all();
+    for (auto& w : workers) w.join();
+}
+
+void ThreadPool::run_job(void* f, JobCall call) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = f;
+        job_call = call;
+        pending = n_threads - 1;
+        generation++;
+    }
+    start.notify_all();
+
+    call(f, 0);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&]{ return pending == 0; });
+    job = nullptr;
+}
+
+void ThreadPool::share_tasks(size_t n_tasks) {
+    for (int t{0}; t < n_threads; t++) {
+        queues[t].begin = n_tasks * t / n_threads;
+        queues[t].end = n_tasks * (t + 1) / n_threads;
+    }
+}
+
+void ThreadPool::share_tasks(const std::vector<size_t>& shares) {
+    for (int t{0}; t < n_threads; t++) {
+        queues[t].begin = shares[t];
+        queues[t].end = shares[t + 1];
+    }
+}
+
+bool ThreadPool::next_task(int t, size_t& task) {
+    TaskQueue& own = queues[t];
+    while (true) {
+        // Take the next task of this thread's own share
+        {
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (own.begin < own.end) {
+                task = own.begin++;
+                return true;
+            }
+        }
+
+        // Out of work, steal from the other threads in turn until they
+        // are all empty
+        bool stolen{false};
+        for (int n{1}; n < n_threads && !stolen; n++) {
+            TaskQueue& victim = queues[(t + n) % n_threads];
+            size_t begin, end;
+            {
+                std::lock_guard<std::mutex> lock(victim.mutex);
+                if (victim.begin >= victim.end) continue;
+                end = victim.end;
+                begin = victim.end - (victim.end - victim.begin + 1) / 2;
+                victim.end = begin;
+            }
+            std::lock_guard<std::mutex> lock(own.mutex);
+            own.begin = begin;
+            own.end = end;
+            stolen = true;
+        }
+        if (!stolen) return false;
+    }
+}
+
+void ThreadPool::work(int thread) {
+    unsigned long seen{0};
+    while (true) {
+        void* f;
+        JobCall call;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            start.wait(lock, [&]{ return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+            f = job;
+            call = job_call;
+        }
+
+        call(f, thread);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending--;
+        }
+        done.notify_one();
+    }
+}
@@ -0,0 +1,105 @@
+#ifndef INC_3DMOLECULARDYNAMICS_THREADPOOL_H
+#define INC_3DMOLECULARDYNAMICS_THREADPOOL_H
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+/// Fixed set of worker threads that live as long as the pool.
+///
+/// The calling thread takes part in every job as thread 0, so a pool of
+/// one thread runs jobs inline without any synchronisation.
+class ThreadPool {
+public:
+    /// Starts n_threads - 1 workers, n_threads <= 0 uses every hardware thread.
+    explicit ThreadPool(int n_threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const { return n_threads; }
+
+    /// Runs f(thread) once on every thread and waits for all of them. The
+    /// pool only keeps a pointer to f, so a call doesn't allocate.
+    template<typename F>
+    void run(F&& f) {
+        if (n_threads == 1) {
+            f(0);
+            return;
+        }
+        run_job(&f, [](void* job, int thread){ (*static_cast<std::remove_reference_t<F>*>(job))(thread); });
+    }
+
+    /// Runs f(thread, task) once for each task in [0, n_tasks). Each thread
+    /// starts on its own contiguous share of the tasks and, when that runs
+    /// out, steals the back half of what is left of another thread's. Which
+    /// thread runs a task changes from run to run.
+    template<typename F>
+    void for_each_task(size_t n_tasks, F&& f) {
+        if (n_threads == 1) {
+            for (size_t task{0}; task < n_tasks; task++) f(0, task);
+            return;
+        }
+        share_tasks(n_tasks);
+        run([&](int t){
+            size_t task;
+            while (next_task(t, task)) f(t, task);
+        });
+    }
+
+    /// As above over tasks [shares[0], shares[size()]), thread t starting on
+    /// tasks shares[t] up to shares[t+1], so a thread that keeps its share
+    /// works on the same data from call to call.
+    template<typename F>
+    void for_each_task(const std::vector<size_t>& shares, F&& f) {
+        if (n_threads == 1) {
+            for (size_t task{shares.front()}; task < shares.back(); task++) f(0, task);
+            return;
+        }
+        share_tasks(shares);
+        run([&](int t){
+            size_t task;
+            while (next_task(t, task)) f(t, task);
+        });
+    }
+
+private:
+    void work(int thread);
+
+    /// Runs call(job, thread) on every thread and waits for all of them
+    using JobCall = void (*)(void*, int);
+    void run_job(void* job, JobCall call);
+
+    /// Deals [0, n_tasks) out to the queues, evenly or by the given shares,
+    /// and takes the next task for a thread, stealing if its own queue is
+    /// empty. False once they all are.
+    void share_tasks(size_t n_tasks);
+    void share_tasks(const std::vector<size_t>& shares);
+    bool next_task(int thread, size_t& task);
+
+    /// Tasks [begin, end) still to be run by one thread
+    struct alignas(64) TaskQueue {
+        std::mutex mutex;
+        size_t begin{0};
+        size_t end{0};
+    };
+    std::vector<TaskQueue> queues;
+
+    int n_threads;
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable start;
+    std::condition_variable done;
+    void* job{nullptr};
+    JobCall job_call{nullptr};
+    unsigned long generation{0};
+    int pending{0};
+    bool stopping{false};
+};
+
+
+#endif //INC_3DMOLECULARDYNAMICS_THREADPOOL_H
@@ -0,0 +1,132 @@
+#include "Topology.h"
+
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace {
+
+    /// Parses a sysfs CPU list such as "0-3,8-11"
+    std::vector<int> parse_cpu_list(const std::string& text) {
+        std::vector<int> cpus;
+        std::stringstream stream(text);
+        std::string range;
+        while (std::getline(stream, range, ',')) {
+            if (range.empty() || range == "\n") continue;
+            size_t dash = range.find('-');
+            int first = std::stoi(range.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            for (int c{first}; c <= last; c++) cpus.push_back(c);
+        }
+        return cpus;
+    }
+
+    /// Writes a sorted list of CPUs back as ranges
+    std::string cpu_ranges(const std::vector<int>& cpus) {
+        std::string text;
+        for (size_t n{0}; n < cpus.size();) {
+            size_t m{n};
+            while (m + 1 < cpus.size() && cpus[m + 1] == cpus[m] + 1) m++;
+            if (!text.empty()) text += ",";
+            text += std::to_string(cpus[n]);
+            if (m > n) text += "-" + std::to_string(cpus[m]);
+            n = m + 1;
+        }
+        return text;
+    }
+
+}
+
+Topology::Topology() {
+    std::vector<int> allowed;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int c{0}; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &set)) allowed.push_back(c);
+        }
+    }
+
+    namespace fs = std::filesystem;
+    std::error_code error;
+    std::vector<std::pair<int, std::vector<int>>> found;
+    for (const auto& entry : fs::directory_iterator("/sys/devices/system/node", error)) {
+        std::string name = entry.path().filename().string();
+        if (name.rfind("node", 0) != 0 || name.size() == 4 || !std::isdigit(name[4])) continue;
+        std::ifstream file(entry.path() / "cpulist");
+        std::string text;
+        std::getline(file, text);
+        // Only the CPUs this process is allowed on, as under mpirun --bind-to
+        std::vector<int> cpus;
+        for (int c : parse_cpu_list(text)) {
+            if (std::binary_search(allowed.begin(), allowed.end(), c)) cpus.push_back(c);
+        }
+        if (!cpus.empty()) found.emplace_back(std::stoi(name.substr(4)), cpus);
+    }
+    std::sort(found.begin(), found.end());
+    for (auto& node : found) {
+        node_ids.push_back(node.first);
+        node_cpus.push_back(std::move(node.second));
+    }
+#endif
+    if (node_cpus.empty()) {
+        if (allowed.empty()) {
+            for (int c{0}; c < std::max(int(std::thread::hardware_concurrency()), 1); c++) allowed.push_back(c);
+        }
+        node_ids.push_back(0);
+        node_cpus.push_back(allowed);
+    }
+}
+
+int Topology::cpus() const {
+    int n{0};
+    for (const std::vector<int>& node : node_cpus) n += int(node.size());
+    return n;
+}
+
+int Topology::node_of(int cpu) const {
+    for (int n{0}; n < nodes(); n++) {
+        if (std::find(node_cpus[n].begin(), node_cpus[n].end(), cpu) != node_cpus[n].end()) return node_ids[n];
+    }
+    return -1;
+}
+
+std::vector<int> Topology::place(int n_threads) const {
+    // Thread t takes the CPU t/n_threads of the way along the CPUs listed
+    // node by node
+    std::vector<int> all;
+    for (const std::vector<int>& node : node_cpus) all.insert(all.end(), node.begin(), node.end());
+    std::vector<int> placed(n_threads);
+    for (int t{0}; t < n_threads; t++) {
+        placed[t] = all[size_t(t) * all.size() / n_threads];
+    }
+    return placed;
+}
+
+std::string Topology::describe() const {
+    std::string text = std::to_string(nodes()) + (nodes() == 1 ? " NUMA node" : " NUMA nodes");
+    for (int n{0}; n < nodes(); n++) {
+        text += ", node " + std::to_string(node_ids[n]) + ": CPUs " + cpu_ranges(node_cpus[n]);
+    }
+    return text;
+}
+
+bool pin_this_thread(int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
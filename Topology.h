@@ -0,0 +1,39 @@
+#ifndef INC_3DMOLECULARDYNAMICS_TOPOLOGY_H
+#define INC_3DMOLECULARDYNAMICS_TOPOLOGY_H
+
+#include <string>
+#include <vector>
+
+/// CPUs this process may run on, grouped by NUMA node.
+///
+/// Read from /sys/devices/system/node on Linux. Without it, or on other
+/// systems, every CPU is taken to be on a single node.
+class Topology {
+public:
+    Topology();
+
+    int nodes() const { return int(node_cpus.size()); }
+    int cpus() const;
+
+    /// Node of a CPU, as numbered by the system, -1 if this process can't
+    /// run on it
+    int node_of(int cpu) const;
+
+    /// CPU for each of n_threads threads. Threads are dealt out to the nodes
+    /// in runs, so threads next to each other (with neighbouring shares of
+    /// the work) share a node, and spread over the CPUs of each node.
+    std::vector<int> place(int n_threads) const;
+
+    /// e.g. "2 NUMA nodes, node 0: CPUs 0-15, node 1: CPUs 16-31"
+    std::string describe() const;
+
+private:
+    std::vector<int> node_ids;
+    std::vector<std::vector<int>> node_cpus;
+};
+
+/// Pins the calling thread to a CPU, returns false if it can't be done.
+bool pin_this_thread(int cpu);
+
+
+#endif //INC_3DMOLECULARDYNAMICS_TOPOLOGY_H
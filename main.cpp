@@ -2,9 +2,14 @@
 #include "Engine.h"
 #include <string>
 #include "Options.h"
+#include "Domain.h"
 
 
 int main(int argc, char** argv){
+    MpiSession mpi(argc, argv);
+    // Only the first process reports
+    if (mpi.rank() != 0) std::cout.rdbuf(nullptr);
+
     const char* fname;
     for (int i = 0; i<argc; i++){
         std::cout << argv[i] << "\n";
@@ -15,25 +20,26 @@ int main(int argc, char** argv){
     }
 
     Options options = read_input_file(fname);
+    if (options.programOptions.experiment == "weak_scaling") {
+        // Each process gets a plate the size of the one in the options
+        int px{1}, py{1};
+        Domain::choose_grid(mpi.size(), options.systemProps.lx, options.systemProps.ly, mpi.size(), mpi.size(), px, py);
+        options.systemProps.lx *= px;
+        options.systemProps.ly *= py;
+    }
     Engine engine(options);
 
 
     if (options.programOptions.experiment == "stable") {
         engine.set_baseplate(options.programOptions.amplitude, 0.02);
-        for (int s{0}; s <= options.programOptions.steps; s++) {
-            engine.step();
-        }
+        engine.run(options.programOptions.steps + 1);
     }
 
     else if (options.programOptions.experiment == "startstop"){
         engine.set_baseplate(options.programOptions.amplitude, 0.02);
-        for (int s{0}; s <= options.programOptions.steps/2; s++) {
-            engine.step();
-        }
+        engine.run(options.programOptions.steps/2 + 1);
         engine.set_baseplate(0.0, 0.02);
-        for (int s{0}; s<=options.programOptions.steps/2; s++){
-            engine.step();
-        }
+        engine.run(options.programOptions.steps/2 + 1);
     }
 
     else if (options.programOptions.experiment == "ramp"){
@@ -44,15 +50,39 @@ int main(int argc, char** argv){
         double end = options.programOptions.amplitude_end;
         double rate = options.programOptions.ramp_rate;
         double time = std::abs((start - end)/rate);
-        double steps = round(time / options.programOptions.timestep);
-        double interval = (end - start)/steps;
-        for (int s{0}; s<=steps; s++){
-            amp += interval;
-            engine.set_baseplate(amp, 0.02);
-            engine.step();
+        if (options.programOptions.adaptive_timestep) {
+            // The amplitude follows physical time as the step varies
+            double t0 = engine.time();
+            while (engine.time() - t0 < time) {
+                engine.set_baseplate(start + (end - start)*(engine.time() - t0)/time, 0.02);
+                engine.step();
+            }
+        }
+        else {
+            double steps = round(time / options.programOptions.timestep);
+            double interval = (end - start)/steps;
+            for (int s{0}; s<=steps; s++){
+                amp += interval;
+                engine.set_baseplate(amp, 0.02);
+                engine.step();
+            }
         }
     }
 
+    else if (options.programOptions.experiment == "base_benchmark"){
+        // Settle a pile, then time the two base contact models on it
+        engine.set_baseplate(options.programOptions.amplitude, 0.02);
+        engine.run(options.programOptions.steps + 1);
+        engine.benchmark_base_models(1000);
+    }
+
+    else if (options.programOptions.experiment == "weak_scaling"){
+        // Settle the pile, then time steps on it
+        engine.set_baseplate(options.programOptions.amplitude, 0.02);
+        engine.run(options.programOptions.steps + 1);
+        engine.benchmark_steps(1000);
+    }
+
     else {
         std::cout << "Experiment not specified" << std::endl;
     }